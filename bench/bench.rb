@@ -0,0 +1,49 @@
+# Benchmarks Rinku against the corpora in bench/corpus:
+#
+#     $ rake bench
+#     $ ruby -Ilib bench/bench.rb [corpus...]
+#
+# For every corpus this reports the throughput of Rinku.auto_link, a reused
+# Rinku::Linker and extract_links, in MB/s and links/s, plus the number of
+# Ruby objects allocated by a single call.
+begin
+  require 'benchmark/ips'
+rescue LoadError
+  abort "bench.rb needs benchmark-ips: gem install benchmark-ips"
+end
+
+require 'rinku'
+
+corpora = ARGV.empty? ? Dir[File.expand_path('corpus/*', __dir__)].sort : ARGV
+linker = Rinku::Linker.new
+
+def allocations
+  before = GC.stat(:total_allocated_objects)
+  yield
+  GC.stat(:total_allocated_objects) - before
+end
+
+corpora.each do |path|
+  text = File.read(path, encoding: 'UTF-8')
+  links = Rinku.extract_links(text).size
+  mb = text.bytesize / (1024.0 * 1024.0)
+
+  cases = {
+    'Rinku.auto_link' => -> { Rinku.auto_link(text) },
+    'Linker#auto_link' => -> { linker.auto_link(text) },
+    'Linker#extract_links' => -> { linker.extract_links(text) },
+  }
+
+  puts "== #{File.basename(path)} (#{text.bytesize} bytes, #{links} links)"
+
+  report = Benchmark.ips(quiet: true) do |x|
+    x.config(time: 2, warmup: 1)
+    cases.each { |name, run| x.report(name, &run) }
+  end
+
+  report.entries.each do |entry|
+    objects = allocations(&cases[entry.label])
+    puts format("  %-22s %9.1f MB/s %12.0f links/s %6d objects",
+      entry.label, entry.ips * mb, entry.ips * links, objects)
+  end
+end
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Standalone benchmark driver for the autolinker, built straight from the
+ * C sources without Ruby (`rake bench:c` builds and runs it):
+ *
+ *     cc -O2 -DHAVE_PTHREAD_H -Iext/rinku -o rinku_bench bench/rinku_bench.c \
+ *         ext/rinku/{rinku,autolink,buffer,utf8,scan}.c -pthread \
+ *         -Wl,--wrap=malloc,--wrap=realloc,--wrap=free
+ *
+ *     ./rinku_bench [-m autolink|extract|stream] [-t seconds] [-j threads]
+ *         [-l all|urls|emails] [-a link_attr] file...
+ *
+ * With GNU ld's --wrap, every allocation made by the autolinker is
+ * counted; build with -DBENCH_NO_WRAP on linkers without it. `-j` links
+ * with rinku_autolink_parallel in the autolink mode; `-l` and `-a` set
+ * what is linked and the attributes of the links.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rinku.h"
+
+enum bench_mode {
+	BENCH_AUTOLINK,
+	BENCH_EXTRACT,
+	BENCH_STREAM
+};
+
+/* chunk size for the stream mode, about what a socket read returns */
+#define BENCH_STREAM_CHUNK (16 * 1024)
+
+static size_t alloc_calls;
+static size_t alloc_bytes;
+
+#ifndef BENCH_NO_WRAP
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *
+__wrap_malloc(size_t size)
+{
+	alloc_calls++;
+	alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_calls++;
+	alloc_bytes += size;
+	return __real_realloc(ptr, size);
+}
+
+void
+__wrap_free(void *ptr)
+{
+	__real_free(ptr);
+}
+#endif
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *
+read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *data;
+	long len;
+
+	if (file == NULL)
+		return NULL;
+
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = malloc(len > 0 ? len : 1);
+	if (data && fread(data, 1, len, file) != (size_t)len) {
+		free(data);
+		data = NULL;
+	}
+
+	fclose(file);
+	*size = (size_t)len;
+	return data;
+}
+
+/* One call, the way the Ruby binding makes it: a fresh output buffer */
+static int
+bench_once(enum bench_mode mode, const struct rinku_config *cfg,
+	const uint8_t *text, size_t size, int threads)
+{
+	struct buf ob = { NULL, 0, 0, 32 };
+	int count = 0;
+
+	switch (mode) {
+	case BENCH_AUTOLINK:
+		if (threads > 1)
+			count = rinku_autolink_parallel(&ob, text, size, cfg, threads);
+		else
+			count = rinku_autolink_with(&ob, text, size, cfg, NULL, NULL);
+		break;
+
+	case BENCH_EXTRACT: {
+		struct rinku_links links = { NULL, 0, 0 };
+
+		count = rinku_extract_links(&links, text, size, cfg);
+		rinku_links_free(&links);
+		break;
+	}
+
+	case BENCH_STREAM: {
+		struct rinku_stream *st = rinku_stream_new(cfg, NULL, NULL);
+		size_t pos;
+
+		for (pos = 0; pos < size; pos += BENCH_STREAM_CHUNK) {
+			size_t len = size - pos;
+			if (len > BENCH_STREAM_CHUNK)
+				len = BENCH_STREAM_CHUNK;
+
+			rinku_stream_feed(st, &ob, text + pos, len);
+			ob.size = 0;
+		}
+
+		count = rinku_stream_finish(st, &ob);
+		rinku_stream_free(st);
+		break;
+	}
+	}
+
+	bufreset(&ob);
+	return count;
+}
+
+static void
+bench_file(const char *path, enum bench_mode mode,
+	const struct rinku_config *cfg, double seconds, int threads)
+{
+	size_t size, iterations = 0, calls, bytes;
+	double start, elapsed;
+	uint8_t *text;
+	int links;
+
+	text = read_file(path, &size);
+	if (text == NULL) {
+		fprintf(stderr, "rinku_bench: can't read %s\n", path);
+		exit(1);
+	}
+
+	/* warm up, and count the allocations of a single call */
+	calls = alloc_calls;
+	bytes = alloc_bytes;
+	links = bench_once(mode, cfg, text, size, threads);
+	calls = alloc_calls - calls;
+	bytes = alloc_bytes - bytes;
+
+	start = now();
+	do {
+		bench_once(mode, cfg, text, size, threads);
+		iterations++;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+
+	printf("%-24s %8.1f MB/s %12.0f links/s %6zu links %5zu allocs %9zu bytes\n",
+		strrchr(path, '/') ? strrchr(path, '/') + 1 : path,
+		size * iterations / elapsed / (1024 * 1024),
+		links * iterations / elapsed,
+		(size_t)links, calls, bytes);
+
+	free(text);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: rinku_bench [-m autolink|extract|stream] [-t seconds] [-j threads]\n"
+		"                   [-l all|urls|emails] [-a link_attr] file...\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *skip_tags[] = {"a", "pre", "code", "kbd", "script", NULL};
+	enum bench_mode mode = BENCH_AUTOLINK;
+	autolink_mode link_mode = AUTOLINK_ALL;
+	const char *link_attr = NULL;
+	struct rinku_config cfg;
+	double seconds = 1.0;
+	int i = 1, threads = 1;
+
+	for (; i < argc && argv[i][0] == '-'; i += 2) {
+		if (i + 1 >= argc)
+			usage();
+
+		if (strcmp(argv[i], "-t") == 0) {
+			seconds = atof(argv[i + 1]);
+		} else if (strcmp(argv[i], "-j") == 0) {
+			threads = atoi(argv[i + 1]);
+		} else if (strcmp(argv[i], "-a") == 0) {
+			link_attr = argv[i + 1];
+		} else if (strcmp(argv[i], "-l") == 0) {
+			if (strcmp(argv[i + 1], "all") == 0)
+				link_mode = AUTOLINK_ALL;
+			else if (strcmp(argv[i + 1], "urls") == 0)
+				link_mode = AUTOLINK_URLS;
+			else if (strcmp(argv[i + 1], "emails") == 0)
+				link_mode = AUTOLINK_EMAILS;
+			else
+				usage();
+		} else if (strcmp(argv[i], "-m") == 0) {
+			if (strcmp(argv[i + 1], "autolink") == 0)
+				mode = BENCH_AUTOLINK;
+			else if (strcmp(argv[i + 1], "extract") == 0)
+				mode = BENCH_EXTRACT;
+			else if (strcmp(argv[i + 1], "stream") == 0)
+				mode = BENCH_STREAM;
+			else
+				usage();
+		} else {
+			usage();
+		}
+	}
+
+	if (i == argc)
+		usage();
+
+	rinku_config_init(&cfg, link_mode, 0, link_attr, skip_tags);
+
+	for (; i < argc; ++i)
+		bench_file(argv[i], mode, &cfg, seconds, threads);
+
+	return 0;
+}
@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * rinku: the autolinker as a command line tool, for backfills that
+ * shouldn't need Ruby (`rake cli` builds it into tmp/rinku):
+ *
+ *     rinku [options] -o dir file...    link every file into dir/
+ *     rinku [options] [file]            link one file (or stdin) to stdout
+ *     rinku [options] -r [file]         link each line on its own
+ *
+ * Files are handed out to `-j` worker threads (one per core by default),
+ * and so are batches of records with `-r`; records are written back in
+ * the order they were read. The output is what Rinku.auto_link makes
+ * with the same options.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rinku.h"
+
+#ifndef RINKU_HAVE_FILES
+#error "the rinku CLI is built with -DHAVE_UNISTD_H -DHAVE_SYS_UIO_H"
+#endif
+
+/* records are linked in batches of about this many bytes */
+#define RECORD_BATCH (1024 * 1024)
+
+/* zeroes after every record, like the terminator of a Ruby string */
+#define RECORD_PADDING 8
+
+#define MAX_LIST 64
+
+struct file_jobs {
+	pthread_mutex_t lock;
+	char **paths;
+	char **out_paths;
+	int count, next;
+	const struct rinku_config *cfg;
+	int failed;
+};
+
+struct record_batch {
+	uint8_t *data;
+	size_t size, asize;
+	struct buf ob;
+	const struct rinku_config *cfg;
+	pthread_t thread;
+	bool started;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: rinku [-j threads] [-m all|urls|emails] [-a link_attr] [-s tag,...]\n"
+		"             [-S scheme,...] [-d] [-r] [-o dir] [file...]\n"
+		"\n"
+		"  -j  worker threads (default: one per core)\n"
+		"  -m  what to link (default: all)\n"
+		"  -a  attributes added to every link\n"
+		"  -s  tags whose contents aren't linked (default: a,pre,code,kbd,script)\n"
+		"  -S  URL schemes that are linked (default: http,https,ftp)\n"
+		"  -d  link domains without a dot (AUTOLINK_SHORT_DOMAINS)\n"
+		"  -r  link each line of the input on its own\n"
+		"  -o  write each file to the same name in dir (names must differ)\n");
+	exit(2);
+}
+
+/* Splits a comma-separated list in place into a NULL-terminated array */
+static const char **
+split_list(char *list, const char **out)
+{
+	int count = 0;
+	char *item;
+
+	for (item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+		if (count == MAX_LIST - 1)
+			usage();
+		out[count++] = item;
+	}
+
+	out[count] = NULL;
+	return out;
+}
+
+static int
+link_file(const char *in_path, const char *out_path, const struct rinku_config *cfg)
+{
+	struct stat in_st, out_st;
+	struct rinku_output out;
+	int in_fd, out_fd = 1, error = 0;
+
+	in_fd = in_path ? open(in_path, O_RDONLY) : 0;
+	if (in_fd < 0) {
+		fprintf(stderr, "rinku: %s: %s\n", in_path, strerror(errno));
+		return -1;
+	}
+
+	if (out_path) {
+		if (fstat(in_fd, &in_st) < 0) {
+			fprintf(stderr, "rinku: %s: %s\n", in_path, strerror(errno));
+			error = -1;
+		} else if (stat(out_path, &out_st) == 0 &&
+			in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+			fprintf(stderr, "rinku: %s: won't link a file into itself\n", in_path);
+			error = -1;
+		} else if (rinku_output_open(&out, out_path) < 0) {
+			fprintf(stderr, "rinku: %s: %s\n", out_path, strerror(errno));
+			error = -1;
+		}
+
+		if (error) {
+			close(in_fd);
+			return -1;
+		}
+
+		out_fd = out.fd;
+	}
+
+	if (rinku_autolink_fd(in_fd, out_fd, cfg) < 0) {
+		fprintf(stderr, "rinku: %s: %s\n",
+			in_path ? in_path : "<stdin>", strerror(errno));
+		error = -1;
+	}
+
+	if (in_path)
+		close(in_fd);
+
+	/* a failed file leaves what was at its output before */
+	if (out_path && rinku_output_close(&out, error == 0) < 0 && error == 0) {
+		fprintf(stderr, "rinku: %s: %s\n", out_path, strerror(errno));
+		error = -1;
+	}
+
+	return error;
+}
+
+static void *
+file_worker(void *arg)
+{
+	struct file_jobs *jobs = arg;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next < jobs->count ? jobs->next++ : -1;
+		pthread_mutex_unlock(&jobs->lock);
+
+		if (i < 0)
+			return NULL;
+
+		if (link_file(jobs->paths[i], jobs->out_paths[i], jobs->cfg) < 0) {
+			pthread_mutex_lock(&jobs->lock);
+			jobs->failed = 1;
+			pthread_mutex_unlock(&jobs->lock);
+		}
+	}
+}
+
+static const char *
+base_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return slash ? slash + 1 : path;
+}
+
+static int
+compare_base_names(const void *a, const void *b)
+{
+	return strcmp(base_name(*(char * const *)a), base_name(*(char * const *)b));
+}
+
+/*
+ * Every file goes to the same name in `out_dir`, so two inputs with the
+ * same name (from different directories, or given twice) would overwrite
+ * each other, and on different threads at once. That's refused before
+ * anything is written.
+ */
+static char **
+output_paths(char **paths, int count, const char *out_dir)
+{
+	char **out_paths, **sorted;
+	int i, error = 0;
+
+	out_paths = calloc(count, sizeof(*out_paths));
+	sorted = malloc(count * sizeof(*sorted));
+	if (out_paths == NULL || sorted == NULL) {
+		fprintf(stderr, "rinku: out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < count && error == 0; ++i) {
+		const char *name = base_name(paths[i]);
+		int len;
+
+		if (*name == 0) {
+			fprintf(stderr, "rinku: %s: not a file name\n", paths[i]);
+			error = -1;
+			break;
+		}
+
+		len = snprintf(NULL, 0, "%s/%s", out_dir, name);
+		if (len < 0 || (out_paths[i] = malloc((size_t)len + 1)) == NULL ||
+			snprintf(out_paths[i], (size_t)len + 1, "%s/%s", out_dir, name) != len) {
+			fprintf(stderr, "rinku: %s: can't build the output path\n", paths[i]);
+			error = -1;
+		}
+	}
+
+	if (error == 0) {
+		memcpy(sorted, paths, count * sizeof(*sorted));
+		qsort(sorted, count, sizeof(*sorted), compare_base_names);
+
+		for (i = 1; i < count; ++i) {
+			if (compare_base_names(&sorted[i - 1], &sorted[i]) == 0) {
+				fprintf(stderr, "rinku: %s and %s would both be written to %s/%s\n",
+					sorted[i - 1], sorted[i], out_dir, base_name(sorted[i]));
+				error = -1;
+			}
+		}
+	}
+
+	free(sorted);
+
+	if (error) {
+		for (i = 0; i < count; ++i)
+			free(out_paths[i]);
+		free(out_paths);
+		return NULL;
+	}
+
+	return out_paths;
+}
+
+static int
+link_files(char **paths, int count, const char *out_dir,
+	const struct rinku_config *cfg, int threads)
+{
+	struct file_jobs jobs;
+	pthread_t workers[RINKU_PARALLEL_MAX_THREADS];
+	int i, started = 0;
+
+	jobs.out_paths = output_paths(paths, count, out_dir);
+	if (jobs.out_paths == NULL)
+		return -1;
+
+	pthread_mutex_init(&jobs.lock, NULL);
+	jobs.paths = paths;
+	jobs.count = count;
+	jobs.next = 0;
+	jobs.cfg = cfg;
+	jobs.failed = 0;
+
+	if (threads > count)
+		threads = count;
+
+	/* the calling thread is one of the workers */
+	for (i = 1; i < threads; ++i) {
+		if (pthread_create(&workers[started], NULL, file_worker, &jobs) == 0)
+			started++;
+	}
+
+	file_worker(&jobs);
+
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	for (i = 0; i < count; ++i)
+		free(jobs.out_paths[i]);
+	free(jobs.out_paths);
+
+	pthread_mutex_destroy(&jobs.lock);
+	return jobs.failed ? -1 : 0;
+}
+
+static void *
+record_worker(void *arg)
+{
+	struct record_batch *batch = arg;
+	uint8_t *rec = batch->data, *end = batch->data + batch->size;
+
+	batch->ob.size = 0;
+
+	while (rec < end) {
+		uint8_t *eol = memchr(rec, '\n', end - rec);
+		size_t len = eol ? (size_t)(eol - rec) : (size_t)(end - rec);
+
+		/* the record is linked as if it were a string of its own */
+		if (eol)
+			*eol = 0;
+
+		if (len > 0 && rinku_autolink_with(&batch->ob, rec, len,
+				batch->cfg, NULL, NULL) == 0)
+			bufput(&batch->ob, rec, len);
+
+		if (eol == NULL)
+			break;
+
+		bufputc(&batch->ob, '\n');
+		rec = eol + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads whole lines into a batch until it holds at least RECORD_BATCH
+ * bytes (or the input ends), moving the start of the line that goes
+ * past the end of the last full one to `next`, which is empty
+ */
+static int
+record_fill(struct record_batch *batch, struct record_batch *next, FILE *in)
+{
+	size_t searched = 0;	/* no newlines before this offset */
+
+	for (;;) {
+		size_t n;
+
+		if (batch->size >= RECORD_BATCH) {
+			size_t cut = batch->size, rest;
+
+			while (cut > searched && batch->data[cut - 1] != '\n')
+				cut--;
+
+			if (cut > searched) {
+				rest = batch->size - cut;
+
+				if (next->asize < rest + RECORD_PADDING) {
+					uint8_t *data = realloc(next->data, rest + RECORD_BATCH * 2);
+
+					if (data == NULL)
+						return -1;
+
+					next->data = data;
+					next->asize = rest + RECORD_BATCH * 2;
+				}
+
+				memcpy(next->data, batch->data + cut, rest);
+				next->size = rest;
+				batch->size = cut;
+				break;
+			}
+
+			searched = batch->size;
+		}
+
+		if (batch->asize - batch->size < RECORD_BATCH / 4 + RECORD_PADDING) {
+			size_t asize = batch->asize ? batch->asize * 2 : RECORD_BATCH * 2;
+			uint8_t *data = realloc(batch->data, asize);
+
+			if (data == NULL)
+				return -1;
+
+			batch->data = data;
+			batch->asize = asize;
+		}
+
+		n = fread(batch->data + batch->size, 1,
+			batch->asize - batch->size - RECORD_PADDING, in);
+		if (n == 0)
+			break;
+
+		batch->size += n;
+	}
+
+	if (ferror(in))
+		return -1;
+
+	if (batch->data)
+		memset(batch->data + batch->size, 0, RECORD_PADDING);
+
+	return 0;
+}
+
+static int
+link_records(FILE *in, const struct rinku_config *cfg, int threads)
+{
+	struct record_batch batches[RINKU_PARALLEL_MAX_THREADS + 1];
+	int i, count, error = 0;
+
+	memset(batches, 0, sizeof(batches));
+	for (i = 0; i <= threads; ++i) {
+		batches[i].ob.unit = 64 * 1024;
+		batches[i].cfg = cfg;
+	}
+
+	/* each round links up to `threads` batches at once and writes them
+	 * out in order; the last slot holds the line carried into the next
+	 * round */
+	while (error == 0) {
+		for (count = 0; count < threads; ++count) {
+			if (record_fill(&batches[count], &batches[count + 1], in) < 0) {
+				fprintf(stderr, "rinku: %s\n", strerror(errno));
+				error = -1;
+				break;
+			}
+
+			if (batches[count].size == 0)
+				break;
+		}
+
+		for (i = 1; i < count; ++i) {
+			batches[i].started = pthread_create(&batches[i].thread, NULL,
+				record_worker, &batches[i]) == 0;
+
+			if (!batches[i].started)
+				record_worker(&batches[i]);
+		}
+
+		if (count > 0)
+			record_worker(&batches[0]);
+
+		for (i = 0; i < count; ++i) {
+			if (batches[i].started) {
+				pthread_join(batches[i].thread, NULL);
+				batches[i].started = false;
+			}
+
+			if (fwrite(batches[i].ob.data, 1, batches[i].ob.size, stdout) <
+				batches[i].ob.size) {
+				fprintf(stderr, "rinku: %s\n", strerror(errno));
+				error = -1;
+			}
+
+			batches[i].size = 0;
+		}
+
+		if (count < threads)
+			break;
+
+		/* the carried-over line starts the next round */
+		if (batches[threads].size > 0) {
+			struct record_batch carry = batches[0];
+
+			batches[0] = batches[threads];
+			batches[threads] = carry;
+		}
+	}
+
+	for (i = 0; i <= threads; ++i) {
+		free(batches[i].data);
+		bufreset(&batches[i].ob);
+	}
+
+	if (fflush(stdout) != 0)
+		error = -1;
+
+	return error;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *skip_tags[MAX_LIST] = {"a", "pre", "code", "kbd", "script", NULL};
+	static const char *schemes[MAX_LIST];
+	autolink_mode mode = AUTOLINK_ALL;
+	const char *link_attr = NULL, *out_dir = NULL;
+	bool records = false, custom_schemes = false;
+	struct rinku_config cfg;
+	unsigned int flags = 0;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, error;
+
+	while ((opt = getopt(argc, argv, "j:m:a:s:S:dro:")) != -1) {
+		switch (opt) {
+		case 'j':
+			threads = atol(optarg);
+			if (threads < 1 || threads > RINKU_PARALLEL_MAX_THREADS)
+				usage();
+			break;
+
+		case 'm':
+			if (strcmp(optarg, "all") == 0)
+				mode = AUTOLINK_ALL;
+			else if (strcmp(optarg, "urls") == 0)
+				mode = AUTOLINK_URLS;
+			else if (strcmp(optarg, "emails") == 0)
+				mode = AUTOLINK_EMAILS;
+			else
+				usage();
+			break;
+
+		case 'a':
+			link_attr = optarg;
+			break;
+
+		case 's':
+			split_list(optarg, skip_tags);
+			break;
+
+		case 'S':
+			split_list(optarg, schemes);
+			custom_schemes = true;
+			break;
+
+		case 'd':
+			flags |= AUTOLINK_SHORT_DOMAINS;
+			break;
+
+		case 'r':
+			records = true;
+			break;
+
+		case 'o':
+			out_dir = optarg;
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > RINKU_PARALLEL_MAX_THREADS)
+		threads = RINKU_PARALLEL_MAX_THREADS;
+
+	if (records ? (out_dir || argc > 1) : (out_dir ? argc == 0 : argc > 1))
+		usage();
+
+	rinku_config_init(&cfg, mode, flags, link_attr, skip_tags);
+	if (custom_schemes)
+		rinku_config_set_schemes(&cfg, schemes);
+
+	if (records) {
+		FILE *in = argc ? fopen(argv[0], "rb") : stdin;
+
+		if (in == NULL) {
+			fprintf(stderr, "rinku: %s: %s\n", argv[0], strerror(errno));
+			return 1;
+		}
+
+		error = link_records(in, &cfg, (int)threads);
+
+		if (in != stdin)
+			fclose(in);
+	} else if (out_dir) {
+		error = link_files(argv, argc, out_dir, &cfg, (int)threads);
+	} else {
+		error = link_file(argc ? argv[0] : NULL, NULL, &cfg);
+	}
+
+	return error ? 1 : 0;
+}
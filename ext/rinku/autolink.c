@@ -35,133 +35,280 @@ is_valid_hostchar(const uint8_t *link, size_t link_len)
 	return !utf8proc_is_space(ch) && !utf8proc_is_punctuation(ch);
 }
 
-bool
-autolink_issafe(const uint8_t *link, size_t link_len)
+/*
+ * How check_domain treats every byte. ASCII space and punctuation other
+ * than '-' end a domain; continuation and invalid bytes read as U+FFFD,
+ * which never does, so only the first byte of a UTF-8 sequence has to
+ * be decoded.
+ */
+enum {
+	HOST_END,
+	HOST_CHAR,
+	HOST_DOT,
+	HOST_USCORE,
+	HOST_UTF8
+};
+
+static const uint8_t host_class[256] = {
+    /*      0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f */
+    /* 0 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 0, 0, 1, 1,
+    /* 1 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 2 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0,
+    /* 3 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    /* 4 */ 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 5 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 3,
+    /* 6 */ 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 7 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    /* 8 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* 9 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* a */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* b */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    /* c */ 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* d */ 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* e */ 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    /* f */ 4, 4, 4, 4, 4, 4, 4, 4, 1, 1, 1, 1, 1, 1, 1, 1};
+
+static inline uint8_t
+scheme_lower(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+void
+autolink_schemes_init(struct autolink_schemes *schemes, const char **names)
 {
-	static const size_t valid_uris_count = 5;
-	static const char *valid_uris[] = {
-		"/", "http://", "https://", "ftp://", "mailto:"
-	};
+	static const char *default_names[] = {"http", "https", "ftp", NULL};
+
+	memset(schemes, 0, sizeof(*schemes));
+
+	if (names == NULL)
+		names = default_names;
+
+	for (; *names != NULL && schemes->count < AUTOLINK_MAX_SCHEMES; ++names) {
+		size_t size = strlen(*names);
+
+		if (size == 0 || size > AUTOLINK_MAX_SCHEME_SIZE)
+			continue;
+
+		schemes->entries[schemes->count].name = *names;
+		schemes->entries[schemes->count].size = size;
+		schemes->count++;
 
+		schemes->lengths[scheme_lower((uint8_t)(*names)[0])] |= (uint32_t)1 << size;
+	}
+}
+
+/* Whether scheme[0..size) names one of the safe schemes, in any case */
+bool
+autolink_issafe(const struct autolink_schemes *schemes,
+	const uint8_t *scheme, size_t size)
+{
 	size_t i;
 
-	for (i = 0; i < valid_uris_count; ++i) {
-		size_t len = strlen(valid_uris[i]);
+	if (size == 0 || size > AUTOLINK_MAX_SCHEME_SIZE ||
+		!(schemes->lengths[scheme_lower(scheme[0])] & ((uint32_t)1 << size)))
+		return false;
 
-		if (link_len > len &&
-			strncasecmp((char *)link, valid_uris[i], len) == 0 &&
-			rinku_isalnum(link[len]))
+	for (i = 0; i < schemes->count; ++i) {
+		if (schemes->entries[i].size == size &&
+			strncasecmp((const char *)scheme, schemes->entries[i].name, size) == 0)
 			return true;
 	}
 
 	return false;
 }
 
-static bool
-autolink_delim(const uint8_t *data, struct autolink_pos *link)
-{
-	int32_t cclose, copen = 0;
-	size_t i;
+/* Every call to autolink_delim_iter trims a link at most this many times */
+#define AUTOLINK_DELIM_ROUNDS 7
 
-	for (i = link->start; i < link->end; ++i)
-		if (data[i] == '<') {
-			link->end = i;
-			break;
+/*
+ * Trims trailing punctuation and HTML entities off text[start..end)
+ * and returns the new end. With AUTOLINK_RAW_TEXT the text isn't
+ * escaped yet, so the bytes that would become entities are trimmed
+ * instead, and a `;` is only punctuation.
+ */
+static size_t
+autolink_trim_punct(const uint8_t *data, size_t start, size_t end,
+	unsigned int flags)
+{
+	while (end > start) {
+		if (strchr("?!.,:", data[end - 1]) != NULL)
+			end--;
+
+		else if (flags & AUTOLINK_RAW_TEXT) {
+			if (data[end - 1] != 0 && strchr(";&<>\"'", data[end - 1]) != NULL)
+				end--;
+			else
+				break;
 		}
 
-	while (link->end > link->start) {
-		if (strchr("?!.,:", data[link->end - 1]) != NULL)
-			link->end--;
-
-		else if (data[link->end - 1] == ';') {
-			size_t new_end = link->end - 2;
+		else if (data[end - 1] == ';') {
+			size_t new_end = end - 2;
 
 			while (new_end > 0 && rinku_isalnum(data[new_end]))
 				new_end--;
 
-			if (new_end < link->end - 2) {
+			if (new_end < end - 2) {
 				if (new_end > 0 && data[new_end] == '#')
 					new_end--;
 
 				if (data[new_end] == '&') {
-					link->end = new_end;
+					end = new_end;
 					continue;
 				}
 			}
-			link->end--;
+			end--;
 		}
 		else break;
 	}
 
-	if (link->end == link->start)
-		return false;
+	return end;
+}
 
-	cclose = utf8proc_rewind(data, link->end);
-	copen = utf8proc_open_paren_character(cclose);
-
-	if (copen != 0) {
-		/* Try to close the final punctuation sign in this link; if
-		 * there's more closing than opening punctuation symbols in the
-		 * URL, we conservatively remove one closing punctuation from
-		 * the end of the URL.
-		 *
-		 * Examples:
-		 *
-		 *	foo http://www.pokemon.com/Pikachu_(Electric) bar
-		 *		=> http://www.pokemon.com/Pikachu_(Electric)
-		 *
-		 *	foo (http://www.pokemon.com/Pikachu_(Electric)) bar
-		 *		=> http://www.pokemon.com/Pikachu_(Electric)
-		 *
-		 *	foo http://www.pokemon.com/Pikachu_(Electric)) bar
-		 *		=> http://www.pokemon.com/Pikachu_(Electric)
-		 *
-		 *	(foo http://www.pokemon.com/Pikachu_(Electric)) bar
-		 *		=> http://www.pokemon.com/Pikachu_(Electric)
-		 */
-
-		size_t closing = 0;
-		size_t opening = 0;
-		size_t i = link->start;
-
-		while (i < link->end) {
-			int32_t c = utf8proc_next(data, &i);
-			if (c == copen)
-				opening++;
-			else if (c == cclose)
-				closing++;
+/*
+ * A trim round that left the link ending in a closing bracket: `end`
+ * is the link after trimming its punctuation and `trimmed` is the link
+ * once that bracket is removed too. The bracket counts are taken over
+ * link->start..end.
+ */
+struct delim_round {
+	size_t end;
+	size_t trimmed;
+	int32_t copen, cclose;
+	int open_slot, close_slot;
+	size_t opening, closing;
+};
+
+static int
+delim_slot(int32_t *chars, int *nchars, int32_t c)
+{
+	int i;
+
+	for (i = 0; i < *nchars; ++i)
+		if (chars[i] == c)
+			return i;
+
+	chars[*nchars] = c;
+	return (*nchars)++;
+}
+
+/*
+ * Trims the end of a link: it's cut at the first '<', then every round
+ * removes trailing punctuation and, when the link is left ending in a
+ * closing bracket without enough opening ones, that bracket. Rounds
+ * stop when a bracket is kept or after `max_rounds`.
+ *
+ *	foo http://www.pokemon.com/Pikachu_(Electric) bar
+ *		=> http://www.pokemon.com/Pikachu_(Electric)
+ *
+ *	foo (http://www.pokemon.com/Pikachu_(Electric)) bar
+ *		=> http://www.pokemon.com/Pikachu_(Electric)
+ *
+ *	foo http://www.pokemon.com/Pikachu_(Electric)) bar
+ *		=> http://www.pokemon.com/Pikachu_(Electric)
+ *
+ *	(foo http://www.pokemon.com/Pikachu_(Electric)) bar
+ *		=> http://www.pokemon.com/Pikachu_(Electric)
+ *
+ * Only the tail of the link is walked for every round. Which ends the
+ * rounds can stop at depends on nothing but that tail, so the brackets
+ * of the whole link are counted for all of them in a single forward
+ * pass afterwards.
+ */
+static bool
+autolink_delim(const uint8_t *data, struct autolink_pos *link, int max_rounds,
+	unsigned int flags)
+{
+	struct delim_round rounds[AUTOLINK_DELIM_ROUNDS];
+	int32_t chars[2 * AUTOLINK_DELIM_ROUNDS];
+	size_t counts[2 * AUTOLINK_DELIM_ROUNDS] = {0};
+	int nrounds = 0, nchars = 0, r;
+	size_t end = link->end, i;
+	bool found = true;
+
+	if (link->end > link->start) {
+		const uint8_t *lt = memchr(data + link->start, '<',
+			link->end - link->start);
+		if (lt != NULL)
+			end = lt - data;
+	}
+
+	while (nrounds < max_rounds) {
+		struct delim_round *round = &rounds[nrounds];
+
+		if (nrounds > 0 && end == 0)
+			break;
+
+		end = autolink_trim_punct(data, link->start, end, flags);
+		if (end == link->start) {
+			found = false;
+			break;
 		}
 
-		if (copen == cclose) {
-			if (opening > 0)
-				utf8proc_back(data, &link->end);
+		round->cclose = utf8proc_rewind(data, end);
+		round->copen = utf8proc_open_paren_character(round->cclose);
+		if (round->copen == 0)
+			break;
+
+		round->end = end;
+		round->open_slot = delim_slot(chars, &nchars, round->copen);
+		round->close_slot = delim_slot(chars, &nchars, round->cclose);
+
+		utf8proc_back(data, &end);
+		round->trimmed = end;
+		nrounds++;
+	}
+
+	/* rounds are ordered by decreasing end, so count backwards */
+	i = link->start;
+	for (r = nrounds - 1; r >= 0; --r) {
+		struct delim_round *round = &rounds[r];
+
+		while (i < round->end) {
+			int32_t c = utf8proc_next(data, &i);
+			int s;
+
+			for (s = 0; s < nchars; ++s) {
+				if (chars[s] == c) {
+					counts[s]++;
+					break;
+				}
+			}
 		}
-		else {
-			if (closing > opening)
-				utf8proc_back(data, &link->end);
+
+		round->opening = counts[round->open_slot];
+		round->closing = counts[round->close_slot];
+	}
+
+	for (r = 0; r < nrounds; ++r) {
+		struct delim_round *round = &rounds[r];
+		bool strip;
+
+		/* Quotes never nest, so any quote still open
+		 * means the final one isn't part of the URL */
+		if (round->copen == round->cclose)
+			strip = round->opening > 0;
+		else
+			strip = round->closing > round->opening;
+
+		if (!strip) {
+			link->end = round->end;
+			return true;
 		}
 	}
 
-	return true;
+	link->end = end;
+	return found;
 }
 
 static bool
-autolink_delim_iter(const uint8_t *data, struct autolink_pos *link)
+autolink_delim_iter(const uint8_t *data, struct autolink_pos *link,
+	unsigned int flags)
 {
-	size_t prev_link_end;
-	int iterations = 0;
-
-	while(link->end != 0) {
-		prev_link_end = link->end;
-		if (!autolink_delim(data, link))
-			return false;
-		if (prev_link_end == link->end || iterations > 5) {
-			break;
-		}
-		iterations++;
-	}
+	if (link->end == 0)
+		return true;
 
-	return true;
+	return autolink_delim(data, link, AUTOLINK_DELIM_ROUNDS, flags);
 }
 
 static bool
@@ -174,21 +321,39 @@ check_domain(const uint8_t *data, size_t size,
 		return false;
 
 	for (i = link->start + 1; i < size - 1; ++i) {
-		if (data[i] == '_') {
+		switch (host_class[data[i]]) {
+		case HOST_CHAR:
+			continue;
+
+		case HOST_USCORE:
 			uscore2++;
-		} else if (data[i] == '.') {
+			continue;
+
+		case HOST_DOT:
 			uscore1 = uscore2;
 			uscore2 = 0;
 			np++;
-		} else if (!is_valid_hostchar(data + i, size - i) && data[i] != '-')
-			break;
+			continue;
+
+		case HOST_UTF8:
+			if (!is_valid_hostchar(data + i, size - i))
+				break;
+
+			/* the rest of the sequence is part of the domain too */
+			while (i + 2 < size && (data[i + 1] & 0xC0) == 0x80)
+				i++;
+			continue;
+		}
+
+		break;
 	}
 
+	/* set either way, so a caller can tell how far it read */
+	link->end = i;
+
 	if (uscore1 > 0 || uscore2 > 0)
 		return false;
 
-	link->end = i;
-
 	if (allow_short) {
 		/* We don't need a valid domain in the strict sense (with
 		 * least one dot; so just make sure it's composed of valid
@@ -208,6 +373,7 @@ autolink__www(
 	const uint8_t *data,
 	size_t pos,
 	size_t size,
+	const struct autolink_schemes *schemes,
 	unsigned int flags)
 {
 	int32_t boundary;
@@ -232,7 +398,7 @@ autolink__www(
 		return false;
 
 	link->end = utf8proc_find_space(data, link->end, size);
-	return autolink_delim_iter(data, link);
+	return autolink_delim_iter(data, link, flags);
 }
 
 bool
@@ -241,6 +407,7 @@ autolink__email(
 	const uint8_t *data,
 	size_t pos,
 	size_t size,
+	const struct autolink_schemes *schemes,
 	unsigned int flags)
 {
 	int nb = 0, np = 0;
@@ -270,9 +437,13 @@ autolink__email(
 		if (rinku_isalnum(c))
 			continue;
 
-		if (c == '@')
-			nb++;
-		else if (c == '.' && link->end < size - 1)
+		/* a second '@' can never match; stop here instead of
+		 * scanning the rest of runs like "a@a@a@..." once for
+		 * every '@' in them */
+		if (c == '@') {
+			if (++nb > 1)
+				return false;
+		} else if (c == '.' && link->end < size - 1)
 			np++;
 		else if (c != '-' && c != '_')
 			break;
@@ -281,7 +452,7 @@ autolink__email(
 	if ((link->end - pos) < 2 || nb != 1 || np == 0 || (np == 1 && data[link->end - 1] == '.'))
 		return false;
 
-	return autolink_delim(data, link);
+	return autolink_delim(data, link, 1, flags);
 }
 
 bool
@@ -290,6 +461,7 @@ autolink__url(
 	const uint8_t *data,
 	size_t pos,
 	size_t size,
+	const struct autolink_schemes *schemes,
 	unsigned int flags)
 {
 	assert(data[pos] == ':');
@@ -309,8 +481,8 @@ autolink__url(
 	while (link->start && rinku_isalpha(data[link->start - 1]))
 		link->start--;
 
-	if (!autolink_issafe(data + link->start, size - link->start))
+	if (!autolink_issafe(schemes, data + link->start, pos - link->start))
 		return false;
 
-	return autolink_delim_iter(data, link);
+	return autolink_delim_iter(data, link, flags);
 }
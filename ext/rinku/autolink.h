@@ -26,6 +26,8 @@ extern "C" {
 
 enum {
 	AUTOLINK_SHORT_DOMAINS = (1 << 0),
+	/* the text is trimmed as it would be once HTML escaped */
+	AUTOLINK_RAW_TEXT = (1 << 8),
 };
 
 struct autolink_pos {
@@ -33,20 +35,57 @@ struct autolink_pos {
 	size_t end;
 };
 
+/* AUTOLINK_MAX_SCHEMES: most URL schemes a table can hold, and
+ * AUTOLINK_MAX_SCHEME_SIZE: the longest scheme name it can hold */
+#define AUTOLINK_MAX_SCHEMES 32
+#define AUTOLINK_MAX_SCHEME_SIZE 31
+
+/*
+ * struct autolink_schemes: the URL schemes that are safe to autolink, by
+ * name ("http" for http:// links). `lengths` has bit N set for every
+ * lowercase first letter that starts an N-letter scheme, so most
+ * candidates are turned down without comparing any names.
+ */
+struct autolink_schemes {
+	struct {
+		const char *name;
+		size_t size;
+	} entries[AUTOLINK_MAX_SCHEMES];
+	size_t count;
+	uint32_t lengths[256];
+};
+
+/*
+ * autolink_schemes_init: compiles a NULL-terminated list of scheme names,
+ * which must outlive the table; NULL means http, https and ftp. Names
+ * that are too long and schemes past AUTOLINK_MAX_SCHEMES are ignored.
+ */
+void
+autolink_schemes_init(struct autolink_schemes *schemes, const char **names);
+
 bool
-autolink_issafe(const uint8_t *link, size_t link_len);
+autolink_issafe(const struct autolink_schemes *schemes,
+	const uint8_t *scheme, size_t size);
 
+/*
+ * The detectors: each looks for a link around data[pos] and returns
+ * whether it found one in `res`. When they give up after reading past
+ * `pos`, `res` is left spanning the text they read.
+ */
 bool
 autolink__www(struct autolink_pos *res,
-	const uint8_t *data, size_t pos, size_t size, unsigned int flags);
+	const uint8_t *data, size_t pos, size_t size,
+	const struct autolink_schemes *schemes, unsigned int flags);
 
 bool
 autolink__email(struct autolink_pos *res,
-	const uint8_t *data, size_t pos, size_t size, unsigned int flags);
+	const uint8_t *data, size_t pos, size_t size,
+	const struct autolink_schemes *schemes, unsigned int flags);
 
 bool
 autolink__url(struct autolink_pos *res,
-	const uint8_t *data, size_t pos, size_t size, unsigned int flags);
+	const uint8_t *data, size_t pos, size_t size,
+	const struct autolink_schemes *schemes, unsigned int flags);
 
 #ifdef __cplusplus
 }
@@ -15,14 +15,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define BUFFER_MAX_ALLOC_SIZE (1024 * 1024 * 16) //16mb
-
 #include "buffer.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* MSVC compat */
 #if defined(_MSC_VER)
@@ -63,14 +65,25 @@ bufgrow(struct buf *buf, size_t neosz)
 	if (buf->asize >= neosz)
 		return BUF_OK;
 
-	neoasz = buf->asize + buf->unit;
-	while (neoasz < neosz)
-		neoasz += buf->unit;
+	neoasz = buf->asize / BUF_GROWTH_DEN * BUF_GROWTH_NUM;
+	if (neoasz < buf->asize + buf->unit)
+		neoasz = buf->asize + buf->unit;
+
+	if (neoasz < neosz)
+		neoasz = (neosz + buf->unit - 1) / buf->unit * buf->unit;
 
-	neodata = realloc(buf->data, neoasz);
+	if (neoasz > BUFFER_MAX_ALLOC_SIZE)
+		neoasz = BUFFER_MAX_ALLOC_SIZE;
+
+	if (buf->grow)
+		neodata = buf->grow(buf, neoasz);
+	else
+		neodata = realloc(buf->data, neoasz);
 	if (!neodata)
 		return BUF_ENOMEM;
 
+	RINKU_STAT(buf_reallocs, 1);
+
 	buf->data = neodata;
 	buf->asize = neoasz;
 	return BUF_OK;
@@ -88,6 +101,8 @@ bufnew(size_t unit)
 		ret->data = 0;
 		ret->size = ret->asize = 0;
 		ret->unit = unit;
+		ret->grow = NULL;
+		ret->opaque = NULL;
 	}
 	return ret;
 }
@@ -191,7 +206,8 @@ bufrelease(struct buf *buf)
 	if (!buf)
 		return;
 
-	free(buf->data);
+	if (!buf->grow)
+		free(buf->data);
 	free(buf);
 }
 
@@ -203,7 +219,8 @@ bufreset(struct buf *buf)
 	if (!buf)
 		return;
 
-	free(buf->data);
+	if (!buf->grow)
+		free(buf->data);
 	buf->data = NULL;
 	buf->size = buf->asize = 0;
 }
@@ -223,3 +240,106 @@ bufslurp(struct buf *buf, size_t len)
 	memmove(buf->data, buf->data + len, buf->size);
 }
 
+
+/*
+ * Scratch buffer pools: every thread keeps the buffers it gave back, so
+ * steady-state calls reuse memory instead of allocating and freeing
+ * large blocks every time. A pool is freed when its thread exits; without
+ * pthreads there are no pools and buffers are allocated every time.
+ */
+struct bufpool {
+	struct buf *bufs[BUFPOOL_SLOTS];
+	size_t count;
+	size_t kept;	/* bytes allocated by `bufs` */
+};
+
+#ifdef HAVE_PTHREAD_H
+static pthread_key_t bufpool_key;
+static pthread_once_t bufpool_once = PTHREAD_ONCE_INIT;
+static int bufpool_ready;
+
+static void
+bufpool_free(void *ptr)
+{
+	struct bufpool *pool = ptr;
+	size_t i;
+
+	for (i = 0; i < pool->count; ++i)
+		bufrelease(pool->bufs[i]);
+	free(pool);
+}
+
+static void
+bufpool_key_init(void)
+{
+	bufpool_ready = pthread_key_create(&bufpool_key, bufpool_free) == 0;
+}
+
+static struct bufpool *
+bufpool_current(int create)
+{
+	struct bufpool *pool;
+
+	pthread_once(&bufpool_once, bufpool_key_init);
+	if (!bufpool_ready)
+		return NULL;
+
+	pool = pthread_getspecific(bufpool_key);
+
+	if (pool == NULL && create) {
+		pool = calloc(1, sizeof(*pool));
+
+		if (pool && pthread_setspecific(bufpool_key, pool) != 0) {
+			free(pool);
+			pool = NULL;
+		}
+	}
+
+	return pool;
+}
+#else
+static struct bufpool *
+bufpool_current(int create)
+{
+	return NULL;
+}
+#endif
+
+struct buf *
+bufpool_get(size_t unit)
+{
+	struct bufpool *pool = bufpool_current(0);
+	struct buf *buf;
+
+	if (pool == NULL || pool->count == 0)
+		return bufnew(unit);
+
+	buf = pool->bufs[--pool->count];
+	pool->kept -= buf->asize;
+
+	buf->size = 0;
+	buf->unit = unit;
+	return buf;
+}
+
+void
+bufpool_put(struct buf *buf)
+{
+	struct bufpool *pool;
+
+	if (!buf)
+		return;
+
+	assert(!buf->grow);
+
+	pool = bufpool_current(1);
+	if (pool == NULL || pool->count == BUFPOOL_SLOTS ||
+		pool->kept + buf->asize > BUFPOOL_MAX_KEEP) {
+		bufrelease(buf);
+		return;
+	}
+
+	buf->size = 0;
+	pool->kept += buf->asize;
+	pool->bufs[pool->count++] = buf;
+}
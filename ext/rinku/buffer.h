@@ -31,19 +31,46 @@ extern "C" {
 #define inline
 #endif
 
+/* RINKU_API: the functions librinku exports (built with RINKU_SHARED);
+ * everything else stays hidden, as it does in the Ruby extension */
+#if defined(RINKU_SHARED) && defined(__GNUC__)
+#define RINKU_API __attribute__ ((visibility ("default")))
+#else
+#define RINKU_API
+#endif
+
 typedef enum {
 	BUF_OK = 0,
 	BUF_ENOMEM = -1,
 } buferror_t;
 
+/* BUF_GROWTH_NUM/BUF_GROWTH_DEN: geometric growth factor applied by
+ * bufgrow; every reallocation also grows by at least one `unit` */
+#ifndef BUF_GROWTH_NUM
+#define BUF_GROWTH_NUM 3
+#endif
+
+#ifndef BUF_GROWTH_DEN
+#define BUF_GROWTH_DEN 2
+#endif
+
+/* BUFFER_MAX_ALLOC_SIZE: bufgrow never grows a buffer past this size */
+#define BUFFER_MAX_ALLOC_SIZE (1024 * 1024 * 16) //16mb
+
 /* struct buf: character array buffer */
 struct buf {
 	uint8_t *data;		/* actual character data */
 	size_t size;	/* size of the string */
 	size_t asize;	/* allocated size (0 = volatile buffer) */
 	size_t unit;	/* reallocation unit size (0 = read-only buffer) */
+	void *(*grow)(struct buf *, size_t);	/* allocator (NULL = realloc) */
+	void *opaque;	/* data for `grow` */
 };
 
+/* A buffer with a `grow` allocator owns nothing: `grow` returns `data`
+ * moved to a block of at least the given size, or NULL on failure, and
+ * the memory is released by whoever provides it, never by bufreset. */
+
 /* CONST_BUF: global buffer from a string litteral */
 #define BUF_STATIC(string) \
 	{ (uint8_t *)string, sizeof string -1, sizeof string, 0, 0 }
@@ -57,37 +84,50 @@ struct buf {
 	bufput(output, literal, sizeof literal - 1)
 
 /* bufgrow: increasing the allocated size to the given value */
-int bufgrow(struct buf *, size_t);
+RINKU_API int bufgrow(struct buf *, size_t);
 
 /* bufnew: allocation of a new buffer */
-struct buf *bufnew(size_t) __attribute__ ((malloc));
+RINKU_API struct buf *bufnew(size_t) __attribute__ ((malloc));
 
 /* bufnullterm: NUL-termination of the string array (making a C-string) */
-const char *bufcstr(struct buf *);
+RINKU_API const char *bufcstr(struct buf *);
 
 /* bufprefix: compare the beginning of a buffer with a string */
-int bufprefix(const struct buf *buf, const char *prefix);
+RINKU_API int bufprefix(const struct buf *buf, const char *prefix);
 
 /* bufput: appends raw data to a buffer */
-void bufput(struct buf *, const void *, size_t);
+RINKU_API void bufput(struct buf *, const void *, size_t);
 
 /* bufputs: appends a NUL-terminated string to a buffer */
-void bufputs(struct buf *, const char *);
+RINKU_API void bufputs(struct buf *, const char *);
 
 /* bufputc: appends a single char to a buffer */
-void bufputc(struct buf *, int);
+RINKU_API void bufputc(struct buf *, int);
 
 /* bufrelease: decrease the reference count and free the buffer if needed */
-void bufrelease(struct buf *);
+RINKU_API void bufrelease(struct buf *);
 
 /* bufreset: frees internal data of the buffer */
-void bufreset(struct buf *);
+RINKU_API void bufreset(struct buf *);
 
 /* bufslurp: removes a given number of bytes from the head of the array */
-void bufslurp(struct buf *, size_t);
+RINKU_API void bufslurp(struct buf *, size_t);
+
+/* BUFPOOL_SLOTS: scratch buffers kept by each thread, and
+ * BUFPOOL_MAX_KEEP: most memory they may hold between them */
+#define BUFPOOL_SLOTS 8
+#define BUFPOOL_MAX_KEEP (4 * 1024 * 1024)
+
+/* bufpool_get: an empty scratch buffer, reusing the memory of one the
+ * calling thread gave back when there is one */
+struct buf *bufpool_get(size_t);
+
+/* bufpool_put: gives a scratch buffer back to the calling thread's pool,
+ * or frees it if the pool is full or it would go over BUFPOOL_MAX_KEEP */
+void bufpool_put(struct buf *);
 
 /* bufprintf: formatted printing to a buffer */
-void bufprintf(struct buf *, const char *, ...) __attribute__ ((format (printf, 2, 3)));
+RINKU_API void bufprintf(struct buf *, const char *, ...) __attribute__ ((format (printf, 2, 3)));
 
 #ifdef __cplusplus
 }
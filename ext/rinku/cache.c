@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "cache.h"
+
+/* results bigger than this share of the capacity aren't cached, so one
+ * large document can't evict everything else */
+#define CACHE_MAX_SHARE 8
+
+#define CACHE_MIN_BUCKETS 64
+
+/* only used to mix the fallback seed */
+#define HASH_SEED_K0 0x9E3779B97F4A7C15ULL
+#define HASH_SEED_K1 0xC2B2AE3D27D4EB4FULL
+
+struct cache_entry {
+	struct cache_entry *next;	/* in its bucket */
+	struct cache_entry *newer, *older;
+	uint64_t hash;
+	size_t key_size;
+	size_t size;
+	size_t output_size;
+	int count;
+	unsigned int pins;	/* hits still being copied out */
+	bool removed;	/* freed by the last of them */
+	uint8_t data[];	/* the config key, the input, then the output */
+};
+
+struct cache {
+	struct cache_entry **buckets;
+	size_t nbuckets;
+	struct cache_entry *newest, *oldest;
+	struct rinku_cache_stats stats;
+};
+
+static struct cache g_cache;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_LOCK() pthread_mutex_lock(&g_cache_lock)
+#define CACHE_UNLOCK() pthread_mutex_unlock(&g_cache_lock)
+#else
+#define CACHE_LOCK()
+#define CACHE_UNLOCK()
+#endif
+
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = hash_rotl(v1, 13); v1 ^= v0; v0 = hash_rotl(v0, 32); \
+	v2 += v3; v3 = hash_rotl(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = hash_rotl(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = hash_rotl(v1, 17); v1 ^= v2; v2 = hash_rotl(v2, 32); \
+} while (0)
+
+static inline uint64_t
+hash_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* SipHash-1-3: with a secret key, texts that share a bucket can't be
+ * found without it, however many are tried */
+static uint64_t
+cache_hash(const uint8_t *data, size_t size, uint64_t k0, uint64_t k1)
+{
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t m, last = (uint64_t)size << 56;
+	size_t i;
+
+	while (size >= 8) {
+		memcpy(&m, data, 8);
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+		data += 8;
+		size -= 8;
+	}
+
+	for (i = 0; i < size; ++i)
+		last |= (uint64_t)data[i] << (8 * i);
+
+	v3 ^= last;
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t g_hash_key[2];
+
+/* From the system's random source; where there is none, from the clock
+ * and the addresses the process got, which still differ between runs */
+static void
+cache_seed(void)
+{
+	FILE *random = fopen("/dev/urandom", "rb");
+	bool seeded = false;
+
+	if (random) {
+		seeded = fread(g_hash_key, sizeof(g_hash_key), 1, random) == 1;
+		fclose(random);
+	}
+
+	if (!seeded) {
+		g_hash_key[0] = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&g_cache;
+		g_hash_key[1] = (uint64_t)clock() ^ (uint64_t)(uintptr_t)&seeded;
+		g_hash_key[1] = cache_hash((const uint8_t *)g_hash_key,
+			sizeof(g_hash_key), HASH_SEED_K0, HASH_SEED_K1);
+	}
+}
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t g_seed_once = PTHREAD_ONCE_INIT;
+#define CACHE_SEED() pthread_once(&g_seed_once, cache_seed)
+#else
+static bool g_seeded;
+#define CACHE_SEED() do { \
+	if (!g_seeded) { cache_seed(); g_seeded = true; } \
+} while (0)
+#endif
+
+static bool
+key_put(struct rinku_cache_key *key, const void *data, size_t size)
+{
+	if (size > RINKU_CACHE_KEY_MAX - key->size)
+		return false;
+
+	memcpy(key->data + key->size, data, size);
+	key->size += size;
+	return true;
+}
+
+/* Strings go in with their length first, so no two lists of them
+ * serialize the same */
+static bool
+key_put_str(struct rinku_cache_key *key, const char *str, size_t size)
+{
+	uint64_t len = size;
+
+	return key_put(key, &len, sizeof(len)) && key_put(key, str, size);
+}
+
+bool
+rinku_cache_key_init(struct rinku_cache_key *key, const struct rinku_config *cfg)
+{
+	uint32_t mode = (uint32_t)cfg->mode, flags = cfg->flags;
+	uint64_t max_links = cfg->max_links, max_work = cfg->max_work, n;
+	uint8_t has_attr = cfg->link_attr != NULL;
+	const char **tag;
+	size_t i;
+
+	CACHE_SEED();
+	key->size = 0;
+
+	if (!key_put(key, &mode, sizeof(mode)) ||
+		!key_put(key, &flags, sizeof(flags)) ||
+		!key_put(key, &max_links, sizeof(max_links)) ||
+		!key_put(key, &max_work, sizeof(max_work)))
+		return false;
+
+	/* a config without link attributes and one with empty ones differ */
+	if (!key_put(key, &has_attr, 1) ||
+		(has_attr && !key_put_str(key, cfg->link_attr, cfg->link_attr_size)))
+		return false;
+
+	for (n = 0, tag = cfg->skip_tags; *tag; ++tag)
+		n++;
+
+	if (!key_put(key, &n, sizeof(n)))
+		return false;
+
+	for (tag = cfg->skip_tags; *tag; ++tag) {
+		if (!key_put_str(key, *tag, strlen(*tag)))
+			return false;
+	}
+
+	n = cfg->schemes.count;
+	if (!key_put(key, &n, sizeof(n)))
+		return false;
+
+	for (i = 0; i < cfg->schemes.count; ++i) {
+		if (!key_put_str(key, cfg->schemes.entries[i].name,
+			cfg->schemes.entries[i].size))
+			return false;
+	}
+
+	key->hash = cache_hash(key->data, key->size, g_hash_key[0], g_hash_key[1]);
+	return true;
+}
+
+/* The bucket hash of a text under a config: keyed by both the secret
+ * key and the config's own hash */
+static uint64_t
+key_hash(const struct rinku_cache_key *key, const uint8_t *text, size_t size)
+{
+	return cache_hash(text, size, g_hash_key[0] ^ key->hash, g_hash_key[1]);
+}
+
+static size_t
+entry_bytes(const struct cache_entry *entry)
+{
+	return sizeof(*entry) + entry->key_size + entry->size + entry->output_size;
+}
+
+static void
+lru_unlink(struct cache *cache, struct cache_entry *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+}
+
+static void
+lru_push(struct cache *cache, struct cache_entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = cache->newest;
+
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+
+	cache->newest = entry;
+}
+
+static void
+cache_remove(struct cache *cache, struct cache_entry *entry)
+{
+	struct cache_entry **slot = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+
+	while (*slot != entry)
+		slot = &(*slot)->next;
+
+	*slot = entry->next;
+	lru_unlink(cache, entry);
+
+	cache->stats.entries--;
+	cache->stats.bytes -= entry_bytes(entry);
+
+	if (entry->pins == 0)
+		free(entry);
+	else
+		entry->removed = true;
+}
+
+/* Evicts the oldest entries until `needed` more bytes fit */
+static void
+cache_evict(struct cache *cache, size_t needed)
+{
+	while (cache->oldest &&
+		cache->stats.bytes + needed > cache->stats.capacity) {
+		cache_remove(cache, cache->oldest);
+		cache->stats.evictions++;
+	}
+}
+
+/* Doubles the buckets once there are more entries than buckets; if that
+ * fails the chains just get longer */
+static void
+cache_rehash(struct cache *cache)
+{
+	size_t nbuckets = cache->nbuckets ? cache->nbuckets * 2 : CACHE_MIN_BUCKETS;
+	struct cache_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+	size_t i;
+
+	if (buckets == NULL)
+		return;
+
+	for (i = 0; i < cache->nbuckets; ++i) {
+		struct cache_entry *entry = cache->buckets[i], *next;
+
+		for (; entry; entry = next) {
+			struct cache_entry **slot = &buckets[entry->hash & (nbuckets - 1)];
+
+			next = entry->next;
+			entry->next = *slot;
+			*slot = entry;
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->nbuckets = nbuckets;
+}
+
+static struct cache_entry *
+cache_find(struct cache *cache, uint64_t hash,
+	const struct rinku_cache_key *key, const uint8_t *text, size_t size)
+{
+	struct cache_entry *entry;
+
+	if (cache->nbuckets == 0)
+		return NULL;
+
+	for (entry = cache->buckets[hash & (cache->nbuckets - 1)]; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->key_size == key->size &&
+			entry->size == size &&
+			memcmp(entry->data, key->data, key->size) == 0 &&
+			memcmp(entry->data + key->size, text, size) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+size_t
+rinku_cache_capacity(void)
+{
+	return g_cache.stats.capacity;
+}
+
+int
+rinku_cache_set_capacity(size_t capacity)
+{
+#ifndef HAVE_PTHREAD_H
+	if (capacity > 0)
+		return -1;
+#endif
+
+	CACHE_LOCK();
+	g_cache.stats.capacity = capacity;
+	cache_evict(&g_cache, 0);
+
+	if (capacity == 0) {
+		free(g_cache.buckets);
+		g_cache.buckets = NULL;
+		g_cache.nbuckets = 0;
+	}
+	CACHE_UNLOCK();
+
+	return 0;
+}
+
+bool
+rinku_cache_get(const struct rinku_cache_key *key, const uint8_t *text,
+	size_t size, struct rinku_cache_hit *hit)
+{
+	const uint64_t hash = key_hash(key, text, size);
+	struct cache_entry *entry;
+
+	CACHE_LOCK();
+	entry = cache_find(&g_cache, hash, key, text, size);
+
+	if (entry) {
+		lru_unlink(&g_cache, entry);
+		lru_push(&g_cache, entry);
+
+		entry->pins++;
+		hit->output = entry->data + entry->key_size + entry->size;
+		hit->output_size = entry->output_size;
+		hit->count = entry->count;
+		hit->entry = entry;
+		g_cache.stats.hits++;
+	} else {
+		g_cache.stats.misses++;
+	}
+	CACHE_UNLOCK();
+
+	return entry != NULL;
+}
+
+void
+rinku_cache_release(struct rinku_cache_hit *hit)
+{
+	struct cache_entry *entry = hit->entry;
+	bool dead;
+
+	CACHE_LOCK();
+	dead = --entry->pins == 0 && entry->removed;
+	CACHE_UNLOCK();
+
+	if (dead)
+		free(entry);
+}
+
+void
+rinku_cache_put(const struct rinku_cache_key *key, const uint8_t *text, size_t size,
+	const uint8_t *output, size_t output_size, int count)
+{
+	const uint64_t hash = key_hash(key, text, size);
+	struct cache_entry *entry;
+	size_t bytes;
+
+	bytes = sizeof(*entry) + key->size + size + output_size;
+
+	/* a racy read, checked again under the lock below */
+	if (bytes > g_cache.stats.capacity / CACHE_MAX_SHARE)
+		return;
+
+	entry = malloc(bytes);
+	if (entry == NULL)
+		return;
+
+	entry->hash = hash;
+	entry->key_size = key->size;
+	entry->size = size;
+	entry->output_size = output_size;
+	entry->count = count;
+	entry->pins = 0;
+	entry->removed = false;
+	memcpy(entry->data, key->data, key->size);
+	memcpy(entry->data + key->size, text, size);
+	memcpy(entry->data + key->size + size, output, output_size);
+
+	CACHE_LOCK();
+	if (bytes > g_cache.stats.capacity / CACHE_MAX_SHARE ||
+		cache_find(&g_cache, hash, key, text, size) != NULL) {
+		/* turned down, or stored by another thread meanwhile */
+		CACHE_UNLOCK();
+		free(entry);
+		return;
+	}
+
+	cache_evict(&g_cache, bytes);
+
+	if (g_cache.stats.entries >= g_cache.nbuckets)
+		cache_rehash(&g_cache);
+
+	if (g_cache.nbuckets == 0) {
+		CACHE_UNLOCK();
+		free(entry);
+		return;
+	}
+
+	entry->next = g_cache.buckets[hash & (g_cache.nbuckets - 1)];
+	g_cache.buckets[hash & (g_cache.nbuckets - 1)] = entry;
+	lru_push(&g_cache, entry);
+
+	g_cache.stats.entries++;
+	g_cache.stats.bytes += bytes;
+	CACHE_UNLOCK();
+}
+
+void
+rinku_cache_get_stats(struct rinku_cache_stats *stats)
+{
+	CACHE_LOCK();
+	*stats = g_cache.stats;
+	CACHE_UNLOCK();
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RINKU_CACHE_H
+#define RINKU_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "rinku.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The result cache: the output of recent calls, keyed by their input and
+ * config, evicted least recently used first once it holds more than its
+ * capacity in bytes. Inputs and configs are compared in full on every
+ * hit, and the buckets are picked by a hash keyed at random once per
+ * process, so texts can't be made to collide. All of it is behind a
+ * lock, so it can be used from every thread; without pthreads it can't
+ * be turned on.
+ */
+struct rinku_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t entries;
+	size_t bytes;
+	size_t capacity;
+};
+
+/* RINKU_CACHE_KEY_MAX: the longest serialized config; configs whose
+ * options don't fit (very long link attributes, say) aren't cached */
+#define RINKU_CACHE_KEY_MAX 512
+
+struct rinku_cache_key {
+	uint64_t hash;
+	size_t size;
+	uint8_t data[RINKU_CACHE_KEY_MAX];
+};
+
+/* A pinned cache entry: `output` stays valid, even if the entry is
+ * evicted meanwhile, until rinku_cache_release */
+struct rinku_cache_hit {
+	const uint8_t *output;
+	size_t output_size;
+	int count;
+	void *entry;
+};
+
+/* rinku_cache_key_init: serializes a config's options into `key`, so
+ * configs are told apart by all of them; returns false if they don't
+ * fit */
+bool
+rinku_cache_key_init(struct rinku_cache_key *key, const struct rinku_config *cfg);
+
+/* rinku_cache_capacity: 0 when the cache is off. A racy read, only
+ * meant to skip the cache without taking the lock. */
+size_t
+rinku_cache_capacity(void);
+
+/* rinku_cache_set_capacity: changes the capacity in bytes, evicting what
+ * no longer fits (0 empties the cache and turns it off); returns -1 if
+ * there is no cache in this build */
+int
+rinku_cache_set_capacity(size_t capacity);
+
+/* rinku_cache_get: on a hit, pins the entry in `hit` (with an
+ * `output_size` of 0 when the text came out unchanged) and returns true;
+ * the caller copies the output out and releases it */
+bool
+rinku_cache_get(const struct rinku_cache_key *key, const uint8_t *text,
+	size_t size, struct rinku_cache_hit *hit);
+
+void
+rinku_cache_release(struct rinku_cache_hit *hit);
+
+/* rinku_cache_put: stores the output of a call, with an `output_size`
+ * of 0 when the text came out unchanged. Results too big for the cache
+ * are dropped. */
+void
+rinku_cache_put(const struct rinku_cache_key *key, const uint8_t *text, size_t size,
+	const uint8_t *output, size_t output_size, int count);
+
+void
+rinku_cache_get_stats(struct rinku_cache_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
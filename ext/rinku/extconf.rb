@@ -2,5 +2,15 @@ require 'mkmf'
 
 $CFLAGS += ' -fvisibility=hidden'
 
+# Hot-path counters behind Rinku.stats: `gem install rinku -- --enable-stats`
+$defs << '-DRINKU_STATS' if enable_config('stats', false)
+
+# Rinku::Linker's `threads:` option; without pthreads it links on one thread
+have_header('pthread.h') && have_library('pthread', 'pthread_create')
+
+# Rinku.auto_link_file needs unistd.h and sys/uio.h, and maps its input
+# with sys/mman.h
+have_header('unistd.h') && have_header('sys/uio.h') && have_header('sys/mman.h')
+
 dir_config('rinku')
 create_makefile('rinku')
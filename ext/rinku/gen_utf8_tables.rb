@@ -0,0 +1,105 @@
+#!/usr/bin/env ruby
+#
+# Generates utf8_tables.h, the lookup tables behind utf8proc_is_space and
+# utf8proc_is_punctuation, from the Unicode Character Database:
+#
+#     $ ruby ext/rinku/gen_utf8_tables.rb UnicodeData.txt > ext/rinku/utf8_tables.h
+#
+# Spaces are the `Zs` code points plus tab, LF, FF and CR. Punctuation is
+# every `P*` code point plus the ASCII symbols, matching `rinku_ispunct`.
+#
+# The table is two-stage: code points are split into blocks of 256, the
+# first stage maps every block to one of the distinct blocks in the second
+# stage, which stores two bits per code point (UTF8_PROP_SPACE and
+# UTF8_PROP_PUNCT).
+
+BLOCK_SIZE = 256
+MAX_CP = 0x110000
+
+SPACE = 1
+PUNCT = 2
+
+ASCII_SPACES = [0x09, 0x0A, 0x0C, 0x0D]
+ASCII_PUNCT = (0x21..0x7E).reject { |c| c.chr =~ /[0-9A-Za-z]/ }
+
+abort "usage: #{$0} UnicodeData.txt" unless ARGV.size == 1
+
+props = Array.new(MAX_CP, 0)
+range_start = nil
+
+File.foreach(ARGV[0]) do |line|
+  fields = line.split(';')
+  next if fields.size < 3
+
+  cp = fields[0].to_i(16)
+  name = fields[1]
+  category = fields[2]
+
+  # Large ranges are listed as a <..., First> / <..., Last> pair
+  if name.end_with?(', First>')
+    range_start = cp
+    next
+  end
+
+  first = name.end_with?(', Last>') ? range_start : cp
+  bits = 0
+  bits |= SPACE if category == 'Zs'
+  bits |= PUNCT if category.start_with?('P') && cp >= 0x80
+  next if bits == 0
+
+  (first..cp).each { |c| props[c] |= bits }
+end
+
+ASCII_SPACES.each { |c| props[c] |= SPACE }
+ASCII_PUNCT.each { |c| props[c] = PUNCT }
+
+stage1 = []
+stage2 = []
+block_ids = {}
+
+props.each_slice(BLOCK_SIZE) do |block|
+  packed = block.each_slice(4).map do |quad|
+    quad.each_with_index.inject(0) { |byte, (bits, i)| byte | (bits << (i * 2)) }
+  end
+
+  id = block_ids[packed] ||= begin
+    stage2 << packed
+    stage2.size - 1
+  end
+
+  stage1 << id
+end
+
+# Code points past the last block with any property set are looked up
+# without touching the tables
+empty = block_ids[Array.new(BLOCK_SIZE / 4, 0)]
+stage1.pop while stage1.last == empty
+
+abort "too many distinct blocks for a byte index" if stage2.size > 256
+
+def emit_array(type, name, values, per_line)
+  rows = values.each_slice(per_line).map { |row| "\t" + row.join(', ') + ',' }
+  "static const #{type} #{name}[#{values.size}] = {\n#{rows.join("\n")}\n};\n"
+end
+
+puts <<-HEADER
+/*
+ * Generated by gen_utf8_tables.rb from the Unicode Character Database.
+ * Do not edit by hand; see the generator for how to rebuild it.
+ */
+#ifndef RINKU_UTF8_TABLES_H
+#define RINKU_UTF8_TABLES_H
+
+#define UTF8_PROP_SPACE #{SPACE}
+#define UTF8_PROP_PUNCT #{PUNCT}
+#define UTF8_PROP_BLOCK_SHIFT 8
+#define UTF8_PROP_MAX_CP 0x#{(stage1.size * BLOCK_SIZE).to_s(16).upcase}
+
+HEADER
+
+puts emit_array('uint8_t', 'utf8_prop_stage1', stage1, 16)
+puts
+puts emit_array('uint8_t', 'utf8_prop_stage2',
+  stage2.flatten.map { |b| format('0x%02x', b) }, 12)
+puts
+puts '#endif'
@@ -17,43 +17,82 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_UIO_H)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#endif
 
 #include "rinku.h"
 #include "autolink.h"
 #include "buffer.h"
+#include "scan.h"
+#include "stats.h"
 #include "utf8.h"
 
-typedef enum {
-	HTML_TAG_NONE = 0,
-	HTML_TAG_OPEN,
-	HTML_TAG_CLOSE,
-} html_tag;
-
 typedef enum {
 	AUTOLINK_ACTION_NONE = 0,
-	AUTOLINK_ACTION_WWW,
-	AUTOLINK_ACTION_EMAIL,
-	AUTOLINK_ACTION_URL,
+	AUTOLINK_ACTION_WWW = RINKU_LINK_WWW,
+	AUTOLINK_ACTION_EMAIL = RINKU_LINK_EMAIL,
+	AUTOLINK_ACTION_URL = RINKU_LINK_URL,
 	AUTOLINK_ACTION_SKIP_TAG
 } autolink_action;
 
-typedef bool (*autolink_parse_cb)(
-	struct autolink_pos *, const uint8_t *, size_t, size_t, unsigned int);
+#define HREF(s) { s, sizeof s - 1 }
 
-static autolink_parse_cb g_callbacks[] = {
-	NULL,
-	autolink__www,	/* 1 */
-	autolink__email,/* 2 */
-	autolink__url,	/* 3 */
+static const struct {
+	const char *data;
+	size_t size;
+} g_hrefs[] = {
+	{ NULL, 0 },
+	HREF("<a href=\"http://"),
+	HREF("<a href=\"mailto:"),
+	HREF("<a href=\""),
 };
 
-static const char *g_hrefs[] = {
-	NULL,
-	"<a href=\"http://",
-	"<a href=\"mailto:",
-	"<a href=\"",
+/* What RINKU_ESCAPE_HTML replaces each byte with, the same as Rails' `h` */
+static const char g_escape_chars[256] = {
+	['&'] = 1, ['<'] = 2, ['>'] = 3, ['"'] = 4, ['\''] = 5
 };
 
+static const struct {
+	const char *data;
+	size_t size;
+} g_escapes[] = {
+	{ NULL, 0 },
+	HREF("&amp;"),
+	HREF("&lt;"),
+	HREF("&gt;"),
+	HREF("&quot;"),
+	HREF("&#39;"),
+};
+
+#undef HREF
+
+#ifdef RINKU_STATS
+RINKU_THREAD_LOCAL struct rinku_stats rinku_thread_stats;
+#endif
+
+/* Offset of the first `c` in text[i..size), or `size` */
+static inline size_t
+find_byte(const uint8_t *text, size_t i, size_t size, int c)
+{
+	const uint8_t *p = i < size ? memchr(text + i, c, size - i) : NULL;
+
+	return p ? (size_t)(p - text) : size;
+}
+
 /*
  * Rinku assumes valid HTML encoding for all input, but there's still
  * the case where a link can contain a double quote `"` that allows XSS.
@@ -67,9 +106,7 @@ static void print_link(struct buf *ob, const uint8_t *link, size_t size)
 
 	while (i < size) {
 		org = i;
-
-		while (i < size && link[i] != '"')
-			i++;
+		i = find_byte(link, i, size, '"');
 
 		if (i > org)
 			bufput(ob, link + org, i - org);
@@ -82,172 +119,2365 @@ static void print_link(struct buf *ob, const uint8_t *link, size_t size)
 	}
 }
 
-/* From sundown/html/html.c */
-static int
-html_is_tag(const uint8_t *tag_data, size_t tag_size, const char *tagname)
+/*
+ * Writes plain text HTML escaped. Most of it comes in short pieces, the
+ * text between two links or a link itself, so the first bytes of a run
+ * are looked up in the table and only longer runs are scanned for.
+ */
+static void
+escape_html(struct buf *ob, const struct rinku_config *cfg,
+	const uint8_t *text, size_t size)
 {
-	size_t i;
-	int closed = 0;
+	size_t i = 0, org;
+
+	while (i < size) {
+		const size_t short_end = size - i > 16 ? i + 16 : size;
+
+		org = i;
+		while (i < short_end && !g_escape_chars[text[i]])
+			i++;
 
-	if (tag_size < 3 || tag_data[0] != '<')
-		return HTML_TAG_NONE;
+		if (i == short_end && i < size)
+			i = rinku_scan(&cfg->escapes, text, i, size);
 
-	i = 1;
+		if (i > org)
+			bufput(ob, text + org, i - org);
+
+		if (i >= size)
+			break;
 
-	if (tag_data[i] == '/') {
-		closed = 1;
+		bufput(ob, g_escapes[(int)g_escape_chars[text[i]]].data,
+			g_escapes[(int)g_escape_chars[text[i]]].size);
 		i++;
 	}
+}
 
-	for (; i < tag_size; ++i, ++tagname) {
-		if (*tagname == 0)
-			break;
+/* Writes the text between links, escaped if the config says so */
+static inline void
+put_text(struct buf *ob, const struct rinku_config *cfg,
+	const uint8_t *text, size_t size)
+{
+	if (cfg->flags & RINKU_ESCAPE_HTML)
+		escape_html(ob, cfg, text, size);
+	else
+		bufput(ob, text, size);
+}
+
+/*
+ * Make room for a link that is about to be written, plus the rest of the
+ * input. The markup overhead for the remainder of the document is
+ * extrapolated from the density of links seen so far, so link-heavy
+ * documents settle after a handful of reallocations instead of growing
+ * the buffer for every link.
+ */
+static void
+reserve_output(struct buf *ob, size_t needed,
+	size_t scanned, size_t remaining, int link_count)
+{
+	size_t expected = ob->size + needed + remaining;
+
+	if (scanned > 0)
+		expected += (size_t)(link_count + 1) * remaining / scanned * needed;
+
+	bufgrow(ob, expected);
+}
+
+static inline uint8_t
+ascii_lower(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+static inline size_t
+skip_hash_step(size_t h, uint8_t c)
+{
+	return h * 31 + ascii_lower(c);
+}
+
+static bool
+tag_name_eq(const uint8_t *name, size_t size, const char *tag)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		if (ascii_lower(name[i]) != ascii_lower((uint8_t)tag[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Compiles the skip tags into an open-addressing hash table keyed on the
+ * lowercase tag name, so every tag in the input is classified with a
+ * single pass over its name, regardless of how many skip tags there are.
+ * `tags` is usually the config's list; an empty one skips nothing.
+ */
+static void
+skip_tags_compile(struct rinku_config *cfg, const char **tags)
+{
+	const char **tag;
+	size_t count = 0;
+
+	memset(cfg->skip_slots, 0, sizeof(cfg->skip_slots));
+	cfg->skip_max_size = 0;
+
+	for (tag = tags; *tag != NULL; ++tag) {
+		size_t size = strlen(*tag);
+		if (size > cfg->skip_max_size)
+			cfg->skip_max_size = size;
+		count++;
+	}
+
+	cfg->skip_linear = (count > RINKU_SKIP_SLOTS / 2);
+	if (cfg->skip_linear)
+		return;
+
+	for (tag = tags; *tag != NULL; ++tag) {
+		size_t i, h = 0, size = strlen(*tag);
+
+		for (i = 0; i < size; ++i)
+			h = skip_hash_step(h, (uint8_t)(*tag)[i]);
+
+		for (h &= RINKU_SKIP_SLOTS - 1; cfg->skip_slots[h].name != NULL;
+			h = (h + 1) & (RINKU_SKIP_SLOTS - 1)) {
+			if (cfg->skip_slots[h].size == size &&
+				tag_name_eq((const uint8_t *)*tag, size,
+					cfg->skip_slots[h].name))
+				break;
+		}
+
+		cfg->skip_slots[h].name = *tag;
+		cfg->skip_slots[h].size = size;
+	}
+}
+
+static const char *
+skip_tags_lookup(const struct rinku_config *cfg,
+	const uint8_t *name, size_t size, size_t h)
+{
+	if (cfg->skip_linear) {
+		const char **tag;
+
+		for (tag = cfg->skip_tags; *tag != NULL; ++tag) {
+			if (strlen(*tag) == size && tag_name_eq(name, size, *tag))
+				return *tag;
+		}
+
+		return NULL;
+	}
+
+	for (h &= RINKU_SKIP_SLOTS - 1; cfg->skip_slots[h].name != NULL;
+		h = (h + 1) & (RINKU_SKIP_SLOTS - 1)) {
+		if (cfg->skip_slots[h].size == size &&
+			tag_name_eq(name, size, cfg->skip_slots[h].name))
+			return cfg->skip_slots[h].name;
+	}
+
+	return NULL;
+}
+
+/*
+ * If `tag_data` starts with an opening tag for one of the skip tags,
+ * returns that skip tag. Tag names are matched case-insensitively and
+ * must be followed by a space or `>`.
+ */
+static const char *
+skip_tag_open(const struct rinku_config *cfg,
+	const uint8_t *tag_data, size_t tag_size)
+{
+	size_t i = 1, h = 0;
+
+	if (tag_size < 3 || tag_data[0] != '<' || tag_data[1] == '/')
+		return NULL;
+
+	while (i < tag_size && !rinku_isspace(tag_data[i]) && tag_data[i] != '>') {
+		if (i > cfg->skip_max_size)
+			return NULL;
 
-		if (tag_data[i] != *tagname)
-			return HTML_TAG_NONE;
+		h = skip_hash_step(h, tag_data[i]);
+		i++;
 	}
 
 	if (i == tag_size)
-		return HTML_TAG_NONE;
+		return NULL;
+
+	return skip_tags_lookup(cfg, tag_data + 1, i - 1, h);
+}
+
+/* Whether `tag_data` starts with the closing tag for `tagname` */
+static bool
+skip_tag_close(const uint8_t *tag_data, size_t tag_size, const char *tagname)
+{
+	size_t size = strlen(tagname);
+
+	if (tag_size < 3 || tag_data[0] != '<' || tag_data[1] != '/')
+		return false;
 
-	if (rinku_isspace(tag_data[i]) || tag_data[i] == '>')
-		return closed ? HTML_TAG_CLOSE : HTML_TAG_OPEN;
+	if (tag_size <= size + 2 || !tag_name_eq(tag_data + 2, size, tagname))
+		return false;
 
-	return HTML_TAG_NONE;
+	return rinku_isspace(tag_data[size + 2]) || tag_data[size + 2] == '>';
 }
 
 static size_t
 autolink__skip_tag(
-	struct buf *ob,
 	const uint8_t *text,
 	size_t size,
-	const char **skip_tags)
+	const struct rinku_config *cfg)
 {
-	size_t i = 0;
-
-	while (i < size && text[i] != '>')
-		i++;
-
-	while (*skip_tags != NULL) {
-		if (html_is_tag(text, size, *skip_tags) == HTML_TAG_OPEN)
-			break;
+	const char *skip_tag;
+	size_t i = find_byte(text, 0, size, '>');
 
-		skip_tags++;
-	}
+	skip_tag = skip_tag_open(cfg, text, size);
 
-	if (*skip_tags != NULL) {
+	if (skip_tag != NULL) {
 		for (;;) {
-			while (i < size && text[i] != '<')
-				i++;
+			i = find_byte(text, i, size, '<');
 
 			if (i == size)
 				break;
 
-			if (html_is_tag(text + i, size - i, *skip_tags) == HTML_TAG_CLOSE)
+			if (skip_tag_close(text + i, size - i, skip_tag))
 				break;
 
 			i++;
 		}
 
-		while (i < size && text[i] != '>')
-			i++;
+		i = find_byte(text, i, size, '>');
 	}
 
 	return i;
 }
 
-int
-rinku_autolink(
-	struct buf *ob,
-	const uint8_t *text,
-	size_t size,
+void
+rinku_config_init(
+	struct rinku_config *cfg,
 	autolink_mode mode,
 	unsigned int flags,
 	const char *link_attr,
-	const char **skip_tags,
-	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
-	void *payload)
+	const char **skip_tags)
 {
-	size_t i, end;
-	char active_chars[256] = {0};
-	int link_count = 0;
-
-	if (!text || size == 0)
-		return 0;
+	static const char *no_skip_tags[] = {NULL};
 
-	active_chars['<'] = AUTOLINK_ACTION_SKIP_TAG;
+	memset(cfg->active_chars, 0, sizeof(cfg->active_chars));
+	if (!(flags & RINKU_ESCAPE_HTML))
+		cfg->active_chars['<'] = AUTOLINK_ACTION_SKIP_TAG;
 
 	if (mode & AUTOLINK_EMAILS)
-		active_chars['@'] = AUTOLINK_ACTION_EMAIL;
+		cfg->active_chars['@'] = AUTOLINK_ACTION_EMAIL;
 
 	if (mode & AUTOLINK_URLS) {
-		active_chars['w'] = AUTOLINK_ACTION_WWW;
-		active_chars['W'] = AUTOLINK_ACTION_WWW;
-		active_chars[':'] = AUTOLINK_ACTION_URL;
+		cfg->active_chars['w'] = AUTOLINK_ACTION_WWW;
+		cfg->active_chars['W'] = AUTOLINK_ACTION_WWW;
+		cfg->active_chars[':'] = AUTOLINK_ACTION_URL;
 	}
 
+	rinku_scan_set_init(&cfg->triggers, cfg->active_chars);
+	rinku_scan_set_init(&cfg->escapes, g_escape_chars);
+
+	cfg->link_attr_size = 0;
+
 	if (link_attr != NULL) {
 		while (rinku_isspace(*link_attr))
 			link_attr++;
+
+		cfg->link_attr_size = strlen(link_attr);
 	}
 
-	bufgrow(ob, size);
+	cfg->mode = mode;
+	cfg->flags = flags;
+	cfg->link_attr = link_attr;
+	cfg->skip_tags = skip_tags ? skip_tags : no_skip_tags;
+	cfg->max_links = cfg->max_work = 0;
+	/* escaped plain text has no tags to skip */
+	skip_tags_compile(cfg, (flags & RINKU_ESCAPE_HTML) ? no_skip_tags : cfg->skip_tags);
+	autolink_schemes_init(&cfg->schemes, NULL);
+}
+
+void
+rinku_config_set_schemes(struct rinku_config *cfg, const char **schemes)
+{
+	autolink_schemes_init(&cfg->schemes, schemes);
+}
+
+void
+rinku_config_set_budget(struct rinku_config *cfg, size_t max_links, size_t max_work)
+{
+	cfg->max_links = max_links;
+	cfg->max_work = max_work;
+}
 
-	i = end = 0;
+/*
+ * What a call has spent of the limits of its config. Calls on a config
+ * without limits track nothing and pass NULL around instead.
+ */
+struct autolink_budget {
+	size_t links;
+	size_t work;
+	bool truncated;
+};
 
-	while (i < size) {
-		struct autolink_pos link;
-		bool link_found;
-		char action = 0;
+static inline bool
+autolink__limited(const struct rinku_config *cfg)
+{
+	return cfg->max_links != 0 || cfg->max_work != 0;
+}
+
+/* A fresh budget for a call, or NULL if its config has no limits */
+static inline struct autolink_budget *
+autolink__budget(struct autolink_budget *budget, const struct rinku_config *cfg)
+{
+	if (!autolink__limited(cfg))
+		return NULL;
+
+	memset(budget, 0, sizeof(*budget));
+	return budget;
+}
+
+/* Bytes a detector read around `pos`, as far as the link it leaves
+ * behind tells: a failed one leaves it over what it read, if anything */
+static inline size_t
+autolink__examined(const struct autolink_pos *link, size_t pos)
+{
+	const size_t lo = link->start < pos ? link->start : pos;
+	const size_t hi = link->end > pos ? link->end : pos + 1;
+
+	return hi - lo;
+}
+
+/*
+ * Runs the detector for `action`. When `mode` is a constant, the
+ * detectors that mode never triggers are compiled out.
+ */
+static inline __attribute__((always_inline)) bool
+autolink__detect(
+	struct autolink_pos *link,
+	char action,
+	const uint8_t *text,
+	size_t pos,
+	size_t size,
+	const struct rinku_config *cfg,
+	autolink_mode mode)
+{
+	switch (action) {
+	case AUTOLINK_ACTION_WWW:
+		return (mode & AUTOLINK_URLS) &&
+			autolink__www(link, text, pos, size, &cfg->schemes, cfg->flags);
 
-		while (end < size && (action = active_chars[text[end]]) == 0)
-			end++;
+	case AUTOLINK_ACTION_EMAIL:
+		return (mode & AUTOLINK_EMAILS) &&
+			autolink__email(link, text, pos, size, &cfg->schemes, cfg->flags);
 
-		if (end == size) {
-			if (link_count > 0)
-				bufput(ob, text + i, end - i);
+	case AUTOLINK_ACTION_URL:
+		return (mode & AUTOLINK_URLS) &&
+			autolink__url(link, text, pos, size, &cfg->schemes, cfg->flags);
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * Finds the next link that starts at or after `from`, scanning from
+ * `*pos` and skipping over tags the same way the autolinker does. On
+ * success `*pos` is moved to the end of the link. Only triggers before
+ * `limit` are tried, though the detectors read up to `size`.
+ *
+ * With a `budget`, no detector runs once the config's `max_work` is
+ * spent, and no link is found past its `max_links`; the budget is then
+ * marked as truncated and the rest of the text has no links.
+ */
+static inline __attribute__((always_inline)) bool
+autolink__find(
+	struct autolink_pos *link,
+	char *action,
+	const uint8_t *text,
+	size_t *pos,
+	size_t from,
+	size_t limit,
+	size_t size,
+	const struct rinku_config *cfg,
+	autolink_mode mode,
+	struct autolink_budget *budget)
+{
+	bool found;
+
+	size_t end = *pos;
+
+	while (end < limit) {
+		end = rinku_scan(&cfg->triggers, text, end, limit);
+
+		if (end == limit)
 			break;
-		}
 
-		if (action == AUTOLINK_ACTION_SKIP_TAG) {
-			end += autolink__skip_tag(ob,
-				text + end, size - end, skip_tags);
+		*action = cfg->active_chars[text[end]];
+
+		if (*action == AUTOLINK_ACTION_SKIP_TAG) {
+			size_t skipped = autolink__skip_tag(text + end, size - end, cfg);
+
+			RINKU_STAT(tag_triggers, 1);
+			RINKU_STAT(skipped_tag_bytes, skipped);
+			end += skipped;
 			continue;
 		}
 
-		link_found = g_callbacks[(int)action](
-			&link, text, end, size, flags);
+		if (budget) {
+			if (budget->truncated ||
+				(cfg->max_work && budget->work >= cfg->max_work)) {
+				budget->truncated = true;
+				break;
+			}
+
+			link->start = link->end = end;
+		}
 
-		if (link_found && link.start >= i) {
-			const uint8_t *link_str = text + link.start;
-			const size_t link_len = link.end - link.start;
+		RINKU_STAT(attempts[(int)*action], 1);
+		found = autolink__detect(link, *action, text, end, size, cfg, mode);
 
-			bufput(ob, text + i, link.start - i);
-			bufputs(ob, g_hrefs[(int)action]);
-			print_link(ob, link_str, link_len);
+		if (budget)
+			budget->work += autolink__examined(link, end);
 
-			if (link_attr) {
-				BUFPUTSL(ob, "\" ");
-				bufputs(ob, link_attr);
-				bufputc(ob, '>');
-			} else {
-				BUFPUTSL(ob, "\">");
-			}
+		if (found && link->start >= from) {
+			if (budget) {
+				if (cfg->max_links && budget->links == cfg->max_links) {
+					budget->truncated = true;
+					break;
+				}
 
-			if (link_text_cb) {
-				link_text_cb(ob, link_str, link_len, payload);
-			} else {
-				bufput(ob, link_str, link_len);
+				budget->links++;
 			}
 
-			BUFPUTSL(ob, "</a>");
+			RINKU_STAT(matches[(int)*action], 1);
+			RINKU_STAT(bytes_scanned, link->end - *pos);
+			*pos = link->end;
+			return true;
+		}
+
+		end++;
+	}
+
+	RINKU_STAT(bytes_scanned, limit - *pos);
+	*pos = limit;
+	return false;
+}
+
+/*
+ * Writes the opening `<a>` tag for a link; `href` is set to where the
+ * link was written in `ob`, for autolink__link_text
+ */
+static inline __attribute__((always_inline)) void
+autolink__open_tag(
+	struct buf *ob,
+	const uint8_t *link_str,
+	size_t link_len,
+	char action,
+	const struct rinku_config *cfg,
+	bool has_attr,
+	struct autolink_pos *href)
+{
+	bufput(ob, g_hrefs[(int)action].data, g_hrefs[(int)action].size);
+	href->start = ob->size;
+
+	if (cfg->flags & RINKU_ESCAPE_HTML)
+		escape_html(ob, cfg, link_str, link_len);
+	else
+		print_link(ob, link_str, link_len);
+
+	href->end = ob->size;
+
+	if (has_attr) {
+		BUFPUTSL(ob, "\" ");
+		bufput(ob, cfg->link_attr, cfg->link_attr_size);
+		bufputc(ob, '>');
+	} else {
+		BUFPUTSL(ob, "\">");
+	}
+}
+
+/*
+ * Writes the text of a link. Escaped, it's the same as the `href` just
+ * written, so that's copied instead of escaping the link again.
+ */
+static inline __attribute__((always_inline)) void
+autolink__link_text(
+	struct buf *ob,
+	const uint8_t *link_str,
+	size_t link_len,
+	const struct rinku_config *cfg,
+	const struct autolink_pos *href)
+{
+	const size_t size = href->end - href->start;
+
+	if (!(cfg->flags & RINKU_ESCAPE_HTML)) {
+		bufput(ob, link_str, link_len);
+		return;
+	}
+
+	/* grown first, as the copy comes from the buffer itself */
+	if (bufgrow(ob, ob->size + size) < 0)
+		return;
+
+	memcpy(ob->data + ob->size, ob->data + href->start, size);
+	ob->size += size;
+}
+
+/*
+ * Autolinks text[offset..size). The bytes before `offset` have already
+ * been written out and are only read by the checks that look back from
+ * a link (the boundary before `www.` and UTF-8 rewinding).
+ *
+ * `mode`, `has_attr` and `has_cb` are constants in every copy of this
+ * loop; autolink__range picks the copy for a config once per call.
+ */
+static inline __attribute__((always_inline)) int
+autolink__range_with(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t offset,
+	size_t size,
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload,
+	struct autolink_budget *budget,
+	autolink_mode mode,
+	bool has_attr,
+	bool has_cb)
+{
+	const size_t attr_size = has_attr ? cfg->link_attr_size : 0;
+	struct autolink_pos link, href;
+	size_t i, end;
+	char action = 0;
+	int link_count = 0;
+
+	i = end = offset;
+
+	while (autolink__find(&link, &action, text, &end, i, size, size, cfg, mode, budget)) {
+		const uint8_t *link_str = text + link.start;
+		const size_t link_len = link.end - link.start;
+		const size_t needed = (link.start - i) +
+			2 * link_len + attr_size + 32;
+
+		/* nothing is allocated until the first link is found, and
+		 * then only for this link and the rest of the text */
+		if (link_count == 0)
+			bufgrow(ob, ob->size + needed + (size - link.end));
+		else if (ob->size + needed > ob->asize)
+			reserve_output(ob, needed, link.end - offset,
+				size - link.end, link_count);
 
-			link_count++;
-			end = i = link.end;
+		put_text(ob, cfg, text + i, link.start - i);
+		autolink__open_tag(ob, link_str, link_len, action, cfg, has_attr, &href);
+
+		if (has_cb) {
+			link_text_cb(ob, link_str, link_len, payload);
 		} else {
-			end = end + 1;
+			autolink__link_text(ob, link_str, link_len, cfg, &href);
 		}
+
+		BUFPUTSL(ob, "</a>");
+
+		link_count++;
+		i = link.end;
 	}
 
+	/* escaped text is written out even without links, unless there's
+	 * nothing in it to escape */
+	if (link_count > 0 || ((cfg->flags & RINKU_ESCAPE_HTML) &&
+			rinku_scan(&cfg->escapes, text, i, size) < size))
+		put_text(ob, cfg, text + i, size - i);
+
+	return link_count;
+}
+
+typedef int (*autolink_range_cb)(
+	struct buf *, const uint8_t *, size_t, size_t,
+	const struct rinku_config *,
+	void (*)(struct buf *, const uint8_t *, size_t, void *), void *,
+	struct autolink_budget *);
+
+#define AUTOLINK_RANGE(name, mode, has_attr, has_cb) \
+static int \
+name(struct buf *ob, const uint8_t *text, size_t offset, size_t size, \
+	const struct rinku_config *cfg, \
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *), \
+	void *payload, struct autolink_budget *budget) \
+{ \
+	return autolink__range_with(ob, text, offset, size, cfg, \
+		link_text_cb, payload, budget, mode, has_attr, has_cb); \
+}
+
+#define AUTOLINK_RANGES(name, mode) \
+	AUTOLINK_RANGE(name, mode, false, false) \
+	AUTOLINK_RANGE(name##_attr, mode, true, false) \
+	AUTOLINK_RANGE(name##_cb, mode, false, true) \
+	AUTOLINK_RANGE(name##_attr_cb, mode, true, true)
+
+AUTOLINK_RANGES(autolink__range_urls, AUTOLINK_URLS)
+AUTOLINK_RANGES(autolink__range_emails, AUTOLINK_EMAILS)
+AUTOLINK_RANGES(autolink__range_all, AUTOLINK_ALL)
+
+#undef AUTOLINK_RANGES
+#undef AUTOLINK_RANGE
+
+#define RANGES(name) { name, name##_attr, name##_cb, name##_attr_cb }
+
+/* by mode, then by link attributes (1) and link text callback (2); a
+ * config with no mode never reaches a detector, so any copy will do */
+static const autolink_range_cb g_ranges[4][4] = {
+	RANGES(autolink__range_all),
+	RANGES(autolink__range_urls),
+	RANGES(autolink__range_emails),
+	RANGES(autolink__range_all),
+};
+
+#undef RANGES
+
+static int
+autolink__range(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t offset,
+	size_t size,
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload,
+	struct autolink_budget *budget)
+{
+	const int variant = (cfg->link_attr != NULL) | (link_text_cb != NULL) << 1;
+
+	return g_ranges[cfg->mode & AUTOLINK_ALL][variant](ob, text, offset,
+		size, cfg, link_text_cb, payload, budget);
+}
+
+int
+rinku_autolink_with(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload)
+{
+	return rinku_autolink_limited(ob, text, size, cfg,
+		link_text_cb, payload, NULL);
+}
+
+int
+rinku_autolink_limited(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload,
+	bool *truncated)
+{
+	struct autolink_budget storage, *budget;
+	int link_count;
+
+	if (truncated)
+		*truncated = false;
+
+	if (!text || size == 0)
+		return 0;
+
+	budget = autolink__budget(&storage, cfg);
+	link_count = autolink__range(ob, text, 0, size, cfg,
+		link_text_cb, payload, budget);
+
+	if (truncated && budget)
+		*truncated = budget->truncated;
+
 	return link_count;
 }
+
+/*
+ * Appends `count` links to an array, growing it geometrically. An array
+ * never holds more than INT_MAX links, so every count fits the int the
+ * extract functions return. -1 with errno set if it can't grow.
+ */
+static int
+links_push(struct rinku_links *links, const struct rinku_link *add, size_t count)
+{
+	if (count == 0)
+		return 0;
+
+	if (count > (size_t)INT_MAX - links->count) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	if (links->count + count > links->asize) {
+		size_t asize = links->asize ? links->asize : 16;
+		struct rinku_link *data;
+
+		while (asize < links->count + count)
+			asize += asize / BUF_GROWTH_DEN * (BUF_GROWTH_NUM - BUF_GROWTH_DEN) + 1;
+
+		if (asize > SIZE_MAX / sizeof(*data) ||
+			(data = realloc(links->data, asize * sizeof(*data))) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		links->data = data;
+		links->asize = asize;
+	}
+
+	memcpy(links->data + links->count, add, count * sizeof(*add));
+	links->count += count;
+	return 0;
+}
+
+void
+rinku_links_free(struct rinku_links *links)
+{
+	free(links->data);
+	links->data = NULL;
+	links->count = links->asize = 0;
+}
+
+int
+rinku_extract_links(
+	struct rinku_links *links,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg)
+{
+	struct autolink_budget storage, *budget;
+	struct rinku_link found;
+	struct autolink_pos link;
+	size_t end = 0;
+	char action = 0;
+	int link_count = 0;
+
+	if (!text || size == 0)
+		return 0;
+
+	budget = autolink__budget(&storage, cfg);
+
+	while (autolink__find(&link, &action, text, &end, end, size, size, cfg,
+			cfg->mode, budget)) {
+		found.start = link.start;
+		found.end = link.end;
+		found.kind = (rinku_link_kind)action;
+		if (links_push(links, &found, 1) < 0)
+			return -1;
+		link_count++;
+	}
+
+	return link_count;
+}
+
+int
+rinku_autolink(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	autolink_mode mode,
+	unsigned int flags,
+	const char *link_attr,
+	const char **skip_tags,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload)
+{
+	struct rinku_config cfg;
+
+	if (!text || size == 0)
+		return 0;
+
+	rinku_config_init(&cfg, mode, flags, link_attr, skip_tags);
+	return rinku_autolink_with(ob, text, size, &cfg, link_text_cb, payload);
+}
+
+/*
+ * Streaming: the input is held back until it reaches a point where the
+ * text before it links the same way no matter what follows. Those points
+ * are whitespace outside of any tag and the end of a skipped element;
+ * a tag or element still open at the end of the input is passed through
+ * as it arrives. Text that goes on for RINKU_STREAM_MAX bytes without
+ * one of those points is written out anyway.
+ */
+enum {
+	STREAM_TEXT,		/* plain text, possibly with links */
+	STREAM_TAG,			/* inside a tag, waiting for its `>` */
+	STREAM_SKIP,		/* inside a skipped element */
+	STREAM_SKIP_CLOSE	/* inside the closing tag of a skipped element */
+};
+
+/* RINKU_STREAM_CONTEXT: bytes kept in front of the pending text for the
+ * checks that look back from a link */
+#define RINKU_STREAM_CONTEXT 4
+
+/* RINKU_STREAM_MAX: the most pending text held back. A link that runs
+ * across a forced cut is split there, or missed if it's cut too short. */
+#define RINKU_STREAM_MAX (64 * 1024)
+
+struct rinku_stream {
+	const struct rinku_config *cfg;
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *);
+	void *payload;
+	struct buf *pending;
+	size_t context;		/* bytes at the head of `pending` already written */
+	size_t scanned;		/* bytes of `pending` seen by the state machine */
+	size_t tag_start;
+	size_t skip_start;	/* end of the opening tag of a skipped element */
+	const char *skip_tag;
+	int state;
+	bool tainted;
+	bool tag_passed;	/* the open tag is being written out as it arrives */
+	int link_count;
+	struct autolink_budget budget;	/* for the whole document */
+};
+
+/* Whitespace that ends every link (and every domain) in its tracks */
+static bool
+stream_is_cut(uint8_t c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f';
+}
+
+/*
+ * Length of the UTF-8 sequence at the start of `data`, 0 if it's cut
+ * short by the end of the data, or -1 if it's malformed. U+FFFD counts as
+ * malformed because utf8proc_find_space reads it as the end of the text.
+ */
+static int
+stream_utf8_len(const uint8_t *data, size_t size)
+{
+	int len, n;
+
+	if (data[0] >= 0xC0 && data[0] < 0xE0)
+		len = 2;
+	else if (data[0] >= 0xE0 && data[0] < 0xF0)
+		len = 3;
+	else if (data[0] >= 0xF0 && data[0] < 0xF8)
+		len = 4;
+	else
+		return -1;
+
+	for (n = 1; n < len && (size_t)n < size; ++n)
+		if ((data[n] & 0xC0) != 0x80)
+			return -1;
+
+	if ((size_t)len > size)
+		return 0;
+
+	if (len == 3 && data[0] == 0xEF && data[1] == 0xBF && data[2] == 0xBD)
+		return -1;
+
+	return len;
+}
+
+/*
+ * Returns the end of the well-formed UTF-8 text in data[i..end): `end`
+ * itself, the start of a malformed sequence (setting `malformed`), or the
+ * start of a sequence that runs past the end of the data.
+ */
+static size_t
+stream_utf8_prefix(const uint8_t *data, size_t i, size_t end, size_t size,
+	bool *malformed)
+{
+	*malformed = false;
+
+	while (i < end) {
+		int len;
+
+		if (data[i] < 0x80) {
+			i = rinku_scan_ascii(data, i, end);
+			continue;
+		}
+
+		/* whole blocks of well-formed text go at once, then runs of two
+		 * and three byte sequences, most of any text that isn't ASCII;
+		 * anything else (including U+FFFD) is left to stream_utf8_len */
+		i = rinku_scan_utf8(data, i, end);
+
+		while (i < end && size - i >= 3) {
+			const uint32_t w = data[i] |
+				(uint32_t)data[i + 1] << 8 | (uint32_t)data[i + 2] << 16;
+
+			if ((w & 0xC0C0F0) == 0x8080E0 && w != 0xBDBFEF)
+				i += 3;
+			else if ((w & 0xC0E0) == 0x80C0)
+				i += 2;
+			else
+				break;
+		}
+
+		if (i >= end || data[i] < 0x80)
+			continue;
+
+		len = stream_utf8_len(data + i, size - i);
+		if (len <= 0) {
+			*malformed = (len < 0);
+			return i;
+		}
+
+		i += len;
+	}
+
+	return i;
+}
+
+/*
+ * Where to force a cut in pending[start..end) once it's too long: `end`,
+ * or the start of a UTF-8 sequence that the end cuts short
+ */
+static size_t
+stream_force_cut(const uint8_t *data, size_t start, size_t end)
+{
+	size_t i = end;
+
+	while (i > start && end - i < 4) {
+		i--;
+
+		if ((data[i] & 0xC0) != 0x80) {
+			if (data[i] >= 0xC0 && stream_utf8_len(data + i, end - i) == 0)
+				return i;
+			break;
+		}
+	}
+
+	return end;
+}
+
+/*
+ * Whether the tag open at the end of the pending text can be written out
+ * before its `>` arrives: no link starts inside a tag, so it can as soon
+ * as enough of it is in to tell whether it opens a skipped element.
+ */
+static bool
+stream_tag_pass(struct rinku_stream *st, const uint8_t *data, size_t end)
+{
+	if (st->tag_passed)
+		return true;
+
+	/* a longer name can't be one of the skip tags */
+	if (end - st->tag_start < st->cfg->skip_max_size + 2)
+		return false;
+
+	st->skip_tag = skip_tag_open(st->cfg,
+		data + st->tag_start, end - st->tag_start);
+	st->tag_passed = true;
+	return true;
+}
+
+/* Autolinks pending[start..end), copying it as-is if nothing in it changes */
+static void
+stream_link(struct rinku_stream *st, struct buf *ob, size_t start, size_t end)
+{
+	const uint8_t *data = st->pending->data;
+	const size_t before = ob->size;
+	int count;
+
+	if (end == start)
+		return;
+
+	count = autolink__range(ob, data, start, end,
+		st->cfg, st->link_text_cb, st->payload,
+		autolink__limited(st->cfg) ? &st->budget : NULL);
+
+	if (ob->size == before)
+		bufput(ob, data + start, end - start);
+
+	st->link_count += count;
+}
+
+/*
+ * Runs the state machine over the pending text and writes out everything
+ * that is safe to write. With `final` set, the end of the pending text is
+ * the end of the document.
+ */
+static void
+stream_advance(struct rinku_stream *st, struct buf *ob, bool final)
+{
+	const uint8_t *data = st->pending->data;
+	const size_t size = st->pending->size;
+	size_t start = st->context, cut = st->context, i = st->scanned;
+	size_t run, keep;
+
+	while (i < size) {
+		const uint8_t *p;
+
+		switch (st->state) {
+		case STREAM_TEXT:
+			/* escaped text has no tags */
+			p = (st->cfg->flags & RINKU_ESCAPE_HTML) ? NULL :
+				memchr(data + i, '<', size - i);
+			run = p ? (size_t)(p - data) : size;
+
+			if (!st->tainted) {
+				bool malformed;
+				size_t valid = stream_utf8_prefix(data, i, run, size, &malformed);
+				size_t w = valid;
+
+				while (w > i && !stream_is_cut(data[w - 1]))
+					w--;
+
+				if (w > i)
+					cut = w;
+
+				if (malformed) {
+					/* utf8proc may skip past the next space or
+					 * read to the end of the text from here */
+					st->tainted = true;
+				} else if (valid < run && !final) {
+					i = valid;
+					goto done;
+				}
+			}
+
+			i = run;
+
+			if (i < size) {
+				/* a link never runs past a tag, even one that is
+				 * followed by malformed text */
+				st->tainted = false;
+				st->tag_start = i++;
+				st->state = STREAM_TAG;
+			}
+			break;
+
+		case STREAM_TAG:
+			p = memchr(data + i, '>', size - i);
+			if (p == NULL) {
+				i = size;
+				break;
+			}
+
+			i = p - data + 1;
+
+			if (st->tag_passed) {
+				bufput(ob, data + start, i - start);
+				start = cut = i;
+				st->tag_passed = false;
+			} else {
+				st->skip_tag = skip_tag_open(st->cfg,
+					data + st->tag_start, i - st->tag_start);
+			}
+
+			if (st->skip_tag != NULL) {
+				st->skip_start = i;
+				st->state = STREAM_SKIP;
+			} else {
+				st->state = STREAM_TEXT;
+			}
+			break;
+
+		case STREAM_SKIP:
+			p = memchr(data + i, '<', size - i);
+			if (p == NULL) {
+				i = size;
+				break;
+			}
+
+			i = p - data;
+			if (!final && size - i < strlen(st->skip_tag) + 3)
+				goto done;
+
+			if (skip_tag_close(data + i, size - i, st->skip_tag))
+				st->state = STREAM_SKIP_CLOSE;
+			else
+				i++;
+			break;
+
+		case STREAM_SKIP_CLOSE:
+			p = memchr(data + i, '>', size - i);
+			if (p == NULL) {
+				i = size;
+				break;
+			}
+
+			i = cut = p - data + 1;
+			st->state = STREAM_TEXT;
+
+			/* the element is already being passed through */
+			if (start >= st->skip_start) {
+				bufput(ob, data + start, i - start);
+				start = i;
+			}
+			break;
+		}
+	}
+
+done:
+	if (st->state == STREAM_SKIP || st->state == STREAM_SKIP_CLOSE) {
+		/* everything after the opening tag is copied as-is, so only
+		 * the text before it needs to wait for the end of the element */
+		if (start < st->skip_start) {
+			stream_link(st, ob, start, st->skip_start);
+			start = st->skip_start;
+		}
+
+		bufput(ob, data + start, i - start);
+		start = st->skip_start = i;
+	} else if (st->state == STREAM_TAG && stream_tag_pass(st, data, i)) {
+		/* the text before the tag is linked with the start of the
+		 * tag after it, which it may look at */
+		if (start < st->tag_start)
+			stream_link(st, ob, start, i);
+		else
+			bufput(ob, data + start, i - start);
+
+		start = st->tag_start = i;
+	} else if (final) {
+		stream_link(st, ob, start, size);
+		start = size;
+	} else {
+		/* the text before a tag is as far as it can be cut short */
+		if (size - cut > RINKU_STREAM_MAX)
+			cut = st->state == STREAM_TAG ? st->tag_start :
+				stream_force_cut(data, cut, i);
+
+		stream_link(st, ob, start, cut);
+		start = cut;
+	}
+
+	keep = start < RINKU_STREAM_CONTEXT ? start : RINKU_STREAM_CONTEXT;
+	bufslurp(st->pending, start - keep);
+
+	st->context = keep;
+	st->scanned = i - (start - keep);
+	st->tag_start -= start - keep;
+	st->skip_start -= start - keep;
+}
+
+struct rinku_stream *
+rinku_stream_new(
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload)
+{
+	struct rinku_stream *st = malloc(sizeof(*st));
+
+	if (st == NULL)
+		return NULL;
+
+	memset(st, 0, sizeof(*st));
+	st->cfg = cfg;
+	st->link_text_cb = link_text_cb;
+	st->payload = payload;
+	st->pending = bufpool_get(4096);
+	st->state = STREAM_TEXT;
+
+	if (st->pending == NULL) {
+		free(st);
+		return NULL;
+	}
+
+	return st;
+}
+
+int
+rinku_stream_feed(
+	struct rinku_stream *st,
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size)
+{
+	int before = st->link_count;
+
+	if (!text)
+		return 0;
+
+	/* fed in pieces, so no more than RINKU_STREAM_MAX is ever held back
+	 * on top of a piece */
+	while (size > 0) {
+		size_t len = size < RINKU_STREAM_MAX ? size : RINKU_STREAM_MAX;
+
+		if (bufgrow(st->pending, st->pending->size + len) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		bufput(st->pending, text, len);
+		stream_advance(st, ob, false);
+
+		text += len;
+		size -= len;
+	}
+
+	return st->link_count - before;
+}
+
+int
+rinku_stream_finish(struct rinku_stream *st, struct buf *ob)
+{
+	struct buf *pending = st->pending;
+	int count;
+
+	/* a document cut short in the middle of a UTF-8 sequence is read a
+	 * few bytes past its end, which must look like a terminated string */
+	if (bufgrow(pending, pending->size + RINKU_STREAM_CONTEXT) == BUF_OK)
+		memset(pending->data + pending->size, 0, RINKU_STREAM_CONTEXT);
+
+	stream_advance(st, ob, true);
+	count = st->link_count;
+
+	st->pending->size = 0;
+	st->context = st->scanned = st->tag_start = st->skip_start = 0;
+	st->skip_tag = NULL;
+	st->state = STREAM_TEXT;
+	st->tainted = st->tag_passed = false;
+	st->link_count = 0;
+	memset(&st->budget, 0, sizeof(st->budget));
+
+	return count;
+}
+
+void
+rinku_stream_free(struct rinku_stream *st)
+{
+	if (st == NULL)
+		return;
+
+	bufpool_put(st->pending);
+	free(st);
+}
+
+/*
+ * Relinking: the scan is back in plain text at the end of every link,
+ * and all it reads from a position is bounded by the next whitespace
+ * (or the end of a skipped tag it's in, which it has to scan through
+ * first). So the links before the last whitespace ahead of an edit stay
+ * the same, and nothing from the last of them up to that whitespace can
+ * be a link either: the scan only has to walk the tags in there, and
+ * finds links again from the whitespace on. Past the edit, the scan
+ * has caught up with the old one as soon as it finds a link the old
+ * text had at the same place, far enough from the edit that nothing
+ * read back from links after it reaches the edit. When nothing was cut
+ * out of the text, both scans are also known to be in plain text right
+ * after the edit, and they agree from the next whitespace or '<' on.
+ *
+ * U+FFFD is the one exception to that bound, as utf8proc_find_space
+ * reads it as the end of the text; around one the scan starts from the
+ * last link and doesn't stop early.
+ */
+
+/* Checks that links are in order and within a text of `size` bytes */
+static bool
+links_valid(const struct rinku_link *links, size_t count, size_t size)
+{
+	size_t i, prev = 0;
+
+	for (i = 0; i < count; ++i) {
+		if (links[i].start < prev || links[i].end <= links[i].start ||
+			links[i].end > size ||
+			links[i].kind < RINKU_LINK_WWW || links[i].kind > RINKU_LINK_URL)
+			return false;
+
+		prev = links[i].end;
+	}
+
+	return true;
+}
+
+/* Index of the first link ending after `pos` */
+static size_t
+links_ending_after(const struct rinku_link *links, size_t count, size_t pos)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (links[mid].end <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Where the scan is back in plain text when it's started there at `pos`
+ * and finds no links before `limit`: `limit`, or past the end of a tag
+ * that reaches it. Only the tags are read, which is much cheaper than
+ * the scan.
+ */
+static size_t
+relink_skip_tags(const uint8_t *text, size_t pos, size_t limit, size_t size,
+	const struct rinku_config *cfg)
+{
+	if (cfg->active_chars['<'] != AUTOLINK_ACTION_SKIP_TAG)
+		return limit;
+
+	while (pos < limit) {
+		pos = find_byte(text, pos, limit, '<');
+		if (pos == limit)
+			break;
+
+		/* the scan resumes on the '>', which it never stops at */
+		pos += autolink__skip_tag(text + pos, size - pos, cfg);
+		if (pos < size)
+			pos++;
+	}
+
+	return pos;
+}
+
+/* Whether text[start..end) has a U+FFFD that a link could run past */
+static bool
+relink_has_fffd(const uint8_t *text, size_t start, size_t end)
+{
+	size_t i = start;
+
+	while ((i = find_byte(text, i, end, 0xEF)) + 2 < end) {
+		if (text[i + 1] == 0xBF && text[i + 2] == 0xBD)
+			return true;
+		i++;
+	}
+
+	return false;
+}
+
+/* The first offset at or after `pos` that's past whitespace or on a '<';
+ * no link runs across either, nor reads back from after it past it */
+static size_t
+relink_boundary(const uint8_t *text, size_t pos, size_t size)
+{
+	for (; pos < size; ++pos) {
+		if (text[pos] == '<')
+			return pos;
+		if (stream_is_cut(text[pos]))
+			return pos + 1;
+	}
+
+	return size;
+}
+
+/* Appends old_links[from..count), moved to where they are after the edit */
+static int
+links_push_moved(struct rinku_links *links, const struct rinku_link *old_links,
+	size_t from, size_t count, size_t edit_old_end, size_t edit_new_end)
+{
+	size_t i;
+
+	for (i = from; i < count; ++i) {
+		struct rinku_link moved = old_links[i];
+
+		moved.start = moved.start - edit_old_end + edit_new_end;
+		moved.end = moved.end - edit_old_end + edit_new_end;
+		if (links_push(links, &moved, 1) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int
+rinku_extract_links_edit(
+	struct rinku_links *links,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	const struct rinku_link *old_links,
+	size_t old_count,
+	size_t edit_start,
+	size_t edit_old_end,
+	size_t edit_new_end)
+{
+	struct rinku_link found;
+	struct autolink_pos link;
+	size_t old_size, cut, keep, next, end, limit, sync_next = 0;
+	char action = 0;
+	int link_count;
+
+	if (edit_start > edit_old_end || edit_start > edit_new_end ||
+		edit_new_end > size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	old_size = size - edit_new_end + edit_old_end;
+	if (!links_valid(old_links, old_count, old_size)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* a budget is spent from the start of the text */
+	if (autolink__limited(cfg))
+		return rinku_extract_links(links, text, size, cfg);
+
+	cut = edit_start;
+	while (cut > 0 && !stream_is_cut(text[cut - 1]))
+		cut--;
+
+	keep = cut ? links_ending_after(old_links, old_count, cut - 1) : 0;
+	end = keep ? old_links[keep - 1].end : 0;
+	if (links_push(links, old_links, keep) < 0)
+		return -1;
+	link_count = (int)keep;
+
+	if (end < cut && !relink_has_fffd(text, end, cut))
+		end = relink_skip_tags(text, end, cut, size, cfg);
+
+	/* With nothing cut out, the old scan was in plain text right where
+	 * the edit went in if the new one is there too without being in a
+	 * tag, and in plain text past the inserted text if the new one is.
+	 * The scan can stop at the next boundary after that, unless a link
+	 * (an old one or one it finds) runs across it. */
+	limit = size;
+	if (edit_start == edit_old_end && end <= edit_start &&
+		relink_skip_tags(text, end, edit_start, size, cfg) == edit_start &&
+		relink_skip_tags(text, edit_start, edit_new_end, size, cfg) == edit_new_end) {
+		size_t sync = relink_boundary(text, edit_new_end, size);
+		size_t old_sync = sync - edit_new_end + edit_old_end;
+
+		sync_next = links_ending_after(old_links, old_count, old_sync);
+		if (sync_next == old_count || old_links[sync_next].start >= old_sync)
+			limit = sync;
+	}
+
+	/* the old links the rescan can catch up with */
+	next = links_ending_after(old_links, old_count,
+		edit_old_end + RINKU_STREAM_CONTEXT - 1);
+
+	while (autolink__find(&link, &action, text, &end, end, limit, size, cfg,
+			cfg->mode, NULL)) {
+		if (link.end > limit)
+			limit = size;
+
+		while (next < old_count && old_links[next].start < edit_old_end)
+			next++;
+
+		while (next < old_count &&
+			old_links[next].start - edit_old_end + edit_new_end < link.start)
+			next++;
+
+		if (next < old_count &&
+			old_links[next].start - edit_old_end + edit_new_end == link.start &&
+			old_links[next].end - edit_old_end + edit_new_end == link.end &&
+			old_links[next].kind == (rinku_link_kind)action) {
+			if (links_push_moved(links, old_links, next, old_count,
+					edit_old_end, edit_new_end) < 0)
+				return -1;
+
+			return link_count + (int)(old_count - next);
+		}
+
+		found.start = link.start;
+		found.end = link.end;
+		found.kind = (rinku_link_kind)action;
+		if (links_push(links, &found, 1) < 0)
+			return -1;
+		link_count++;
+	}
+
+	if (limit < size) {
+		if (links_push_moved(links, old_links, sync_next, old_count,
+				edit_old_end, edit_new_end) < 0)
+			return -1;
+
+		link_count += (int)(old_count - sync_next);
+	}
+
+	return link_count;
+}
+
+int
+rinku_render_links(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	const struct rinku_link *links,
+	size_t count,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload)
+{
+	size_t needed = size, i, prev = 0;
+
+	if (!links_valid(links, count, size))
+		return -1;
+
+	if (count == 0) {
+		if ((cfg->flags & RINKU_ESCAPE_HTML) &&
+			rinku_scan(&cfg->escapes, text, 0, size) < size)
+			escape_html(ob, cfg, text, size);
+		return 0;
+	}
+
+	for (i = 0; i < count; ++i)
+		needed += (links[i].end - links[i].start) + cfg->link_attr_size + 32;
+
+	bufgrow(ob, ob->size + needed);
+
+	for (i = 0; i < count; ++i) {
+		const uint8_t *link_str = text + links[i].start;
+		const size_t link_len = links[i].end - links[i].start;
+		struct autolink_pos href;
+
+		put_text(ob, cfg, text + prev, links[i].start - prev);
+		autolink__open_tag(ob, link_str, link_len, (char)links[i].kind,
+			cfg, cfg->link_attr != NULL, &href);
+
+		if (link_text_cb)
+			link_text_cb(ob, link_str, link_len, payload);
+		else
+			autolink__link_text(ob, link_str, link_len, cfg, &href);
+
+		BUFPUTSL(ob, "</a>");
+		prev = links[i].end;
+	}
+
+	put_text(ob, cfg, text + prev, size - prev);
+	return (int)count;
+}
+
+/*
+ * Parallel autolinking: the text is split at the same points where a
+ * stream writes out its output, which link the same way no matter what
+ * they're next to. Every chunk is linked into its own buffer on its own
+ * thread, with the whole text still there for the checks that look back
+ * from a link, and the buffers are joined in order.
+ */
+struct parallel_chunk {
+	const uint8_t *text;
+	size_t start, end;
+	const struct rinku_config *cfg;
+	struct buf *ob;
+	int link_count;
+#ifdef HAVE_PTHREAD_H
+	struct parallel_chunk *next;	/* in the pool's queue */
+	const struct parallel_chunk *owner;	/* the first chunk of its call */
+	bool finished;
+#endif
+#ifdef RINKU_STATS
+	struct rinku_stats stats;
+#endif
+};
+
+/*
+ * Finds up to `max_cuts` split points spread evenly over the text, the
+ * first safe point at or after each target. A point is safe after
+ * whitespace in text with only well-formed UTF-8 since the last tag, or
+ * at the end of a skipped element. Returns the number found.
+ */
+static size_t
+parallel_cuts(const uint8_t *text, size_t size,
+	const struct rinku_config *cfg, size_t *cuts, size_t max_cuts)
+{
+	const char *skip_tag;
+	size_t i = 0, run_start = 0, ncuts = 0, tag_start, target;
+	const uint8_t *p;
+
+	while (ncuts < max_cuts) {
+		size_t run;
+
+		target = size / (max_cuts + 1) * (ncuts + 1);
+
+		p = memchr(text + i, '<', size - i);
+		run = p ? (size_t)(p - text) : size;
+
+		if (run > target) {
+			size_t w = i > target ? i : target;
+			bool malformed;
+
+			for (;;) {
+				w = rinku_scan_plain(text, w, run);
+				if (w == run || stream_is_cut(text[w]))
+					break;
+				w++;
+			}
+
+			if (w + 1 < size && w < run &&
+				stream_utf8_prefix(text, run_start, w + 1, size, &malformed) == w + 1) {
+				cuts[ncuts++] = i = run_start = w + 1;
+				continue;
+			}
+		}
+
+		if (run == size)
+			break;
+
+		/* a tag, and the element it opens if it's skipped */
+		tag_start = run;
+		p = memchr(text + run, '>', size - run);
+		if (p == NULL)
+			break;
+
+		i = p - text + 1;
+		skip_tag = skip_tag_open(cfg, text + tag_start, i - tag_start);
+
+		if (skip_tag != NULL) {
+			for (;;) {
+				p = memchr(text + i, '<', size - i);
+				if (p == NULL)
+					return ncuts;
+
+				i = p - text;
+				if (skip_tag_close(text + i, size - i, skip_tag))
+					break;
+				i++;
+			}
+
+			p = memchr(text + i, '>', size - i);
+			if (p == NULL)
+				break;
+
+			i = p - text + 1;
+			if (i >= target && i < size)
+				cuts[ncuts++] = i;
+		}
+
+		run_start = i;
+	}
+
+	return ncuts;
+}
+
+static void *
+parallel_chunk_run(void *arg)
+{
+	struct parallel_chunk *chunk = arg;
+
+#ifdef RINKU_STATS
+	struct rinku_stats saved = rinku_thread_stats;
+	memset(&rinku_thread_stats, 0, sizeof(rinku_thread_stats));
+#endif
+
+	chunk->link_count = autolink__range(chunk->ob, chunk->text,
+		chunk->start, chunk->end, chunk->cfg, NULL, NULL, NULL);
+
+#ifdef RINKU_STATS
+	chunk->stats = rinku_thread_stats;
+	rinku_thread_stats = saved;
+#endif
+	return NULL;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * The worker pool: threads are started the first time a call needs them,
+ * up to one less than RINKU_PARALLEL_MAX_THREADS, and are then kept
+ * waiting for chunks for the life of the process. Callers queue their
+ * chunks and link any that no worker has picked up yet themselves, so
+ * they finish even when no worker could be started.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* a chunk was queued */
+	pthread_cond_t done;	/* a chunk was finished */
+	struct parallel_chunk *queue;
+	size_t workers;
+} g_pool = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	NULL,
+	0
+};
+
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+/* A forked child has none of the workers, and the lock could have been
+ * held by a thread that isn't there either */
+static void
+pool_atfork_child(void)
+{
+	pthread_mutex_init(&g_pool.lock, NULL);
+	pthread_cond_init(&g_pool.work, NULL);
+	pthread_cond_init(&g_pool.done, NULL);
+	g_pool.queue = NULL;
+	g_pool.workers = 0;
+}
+
+static void
+pool_init(void)
+{
+	pthread_atfork(NULL, NULL, pool_atfork_child);
+}
+
+static void *
+pool_worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&g_pool.lock);
+	for (;;) {
+		struct parallel_chunk *chunk;
+
+		while (g_pool.queue == NULL)
+			pthread_cond_wait(&g_pool.work, &g_pool.lock);
+
+		chunk = g_pool.queue;
+		g_pool.queue = chunk->next;
+		pthread_mutex_unlock(&g_pool.lock);
+
+		parallel_chunk_run(chunk);
+
+		pthread_mutex_lock(&g_pool.lock);
+		chunk->finished = true;
+		pthread_cond_broadcast(&g_pool.done);
+	}
+
+	return NULL;
+}
+
+/* Starts workers, with the lock held, until there are `wanted`. They
+ * block every signal, so signals only reach the process's own threads. */
+static void
+pool_grow(size_t wanted)
+{
+#ifdef SIG_SETMASK
+	sigset_t all, saved;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+#endif
+
+	while (g_pool.workers < wanted) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, pool_worker, NULL) != 0)
+			break;
+
+		pthread_detach(thread);
+		g_pool.workers++;
+	}
+
+#ifdef SIG_SETMASK
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+#endif
+}
+
+/* Unqueues a chunk of the call that `owner` starts, if one is waiting */
+static struct parallel_chunk *
+pool_take(const struct parallel_chunk *owner)
+{
+	struct parallel_chunk **slot, *chunk;
+
+	for (slot = &g_pool.queue; *slot; slot = &(*slot)->next) {
+		if ((*slot)->owner == owner) {
+			chunk = *slot;
+			*slot = chunk->next;
+			return chunk;
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+/* Links every chunk but the first on the pool's workers, and the first
+ * on the calling thread; returns once all of them are done */
+static void
+parallel_chunks_run(struct parallel_chunk *chunks, size_t nchunks)
+{
+	size_t i;
+#ifdef HAVE_PTHREAD_H
+	struct parallel_chunk **slot, *chunk;
+
+	pthread_once(&g_pool_once, pool_init);
+	pthread_mutex_lock(&g_pool.lock);
+	pool_grow(nchunks - 1);
+
+	for (slot = &g_pool.queue; *slot; slot = &(*slot)->next)
+		;
+
+	for (i = 1; i < nchunks; ++i) {
+		chunks[i].owner = chunks;
+		*slot = &chunks[i];
+		slot = &chunks[i].next;
+	}
+
+	*slot = NULL;
+	pthread_cond_broadcast(&g_pool.work);
+	pthread_mutex_unlock(&g_pool.lock);
+
+	parallel_chunk_run(&chunks[0]);
+
+	pthread_mutex_lock(&g_pool.lock);
+	for (i = 1; i < nchunks; ++i) {
+		while (!chunks[i].finished) {
+			chunk = pool_take(chunks);
+
+			if (chunk == NULL) {
+				pthread_cond_wait(&g_pool.done, &g_pool.lock);
+				continue;
+			}
+
+			pthread_mutex_unlock(&g_pool.lock);
+			parallel_chunk_run(chunk);
+			pthread_mutex_lock(&g_pool.lock);
+			chunk->finished = true;
+		}
+	}
+	pthread_mutex_unlock(&g_pool.lock);
+#else
+	for (i = 0; i < nchunks; ++i)
+		parallel_chunk_run(&chunks[i]);
+#endif
+
+#ifdef RINKU_STATS
+	for (i = 0; i < nchunks; ++i)
+		rinku_stats_add(&rinku_thread_stats, &chunks[i].stats);
+#endif
+}
+
+static void
+parallel_chunks_release(struct parallel_chunk *chunks, size_t nchunks)
+{
+	size_t i;
+
+	for (i = 0; i < nchunks; ++i)
+		bufpool_put(chunks[i].ob);
+}
+
+int
+rinku_autolink_parallel(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	int threads)
+{
+	struct parallel_chunk chunks[RINKU_PARALLEL_MAX_THREADS];
+	size_t cuts[RINKU_PARALLEL_MAX_THREADS - 1];
+	size_t nchunks, total = 0, i;
+	bool exact = true;
+	int link_count = 0;
+
+	if (!text || size == 0)
+		return 0;
+
+	if (threads > RINKU_PARALLEL_MAX_THREADS)
+		threads = RINKU_PARALLEL_MAX_THREADS;
+
+	if ((size_t)threads > size / RINKU_PARALLEL_MIN_CHUNK)
+		threads = (int)(size / RINKU_PARALLEL_MIN_CHUNK);
+
+	/* spending a budget in order takes a single pass, and chunks
+	 * without links are copied as they are, not escaped */
+	if (threads < 2 || autolink__limited(cfg) || (cfg->flags & RINKU_ESCAPE_HTML))
+		return rinku_autolink_with(ob, text, size, cfg, NULL, NULL);
+
+	nchunks = parallel_cuts(text, size, cfg, cuts, threads - 1) + 1;
+	if (nchunks < 2)
+		return rinku_autolink_with(ob, text, size, cfg, NULL, NULL);
+
+	memset(chunks, 0, sizeof(chunks[0]) * nchunks);
+
+	for (i = 0; i < nchunks; ++i) {
+		chunks[i].text = text;
+		chunks[i].start = i ? cuts[i - 1] : 0;
+		chunks[i].end = i < nchunks - 1 ? cuts[i] : size;
+		chunks[i].cfg = cfg;
+		chunks[i].ob = bufpool_get(ob->unit);
+
+		if (chunks[i].ob == NULL) {
+			parallel_chunks_release(chunks, i);
+			return rinku_autolink_with(ob, text, size, cfg, NULL, NULL);
+		}
+	}
+
+	parallel_chunks_run(chunks, nchunks);
+
+	for (i = 0; i < nchunks; ++i) {
+		struct parallel_chunk *chunk = &chunks[i];
+		size_t in = chunk->end - chunk->start;
+
+		if (chunk->link_count == 0) {
+			total += in;
+			continue;
+		}
+
+		/* a chunk can only have dropped output if a single write to
+		 * it could have taken it past the limit on buffer sizes */
+		if (chunk->ob->size + in + cfg->link_attr_size + 32 > BUFFER_MAX_ALLOC_SIZE)
+			exact = false;
+
+		total += chunk->ob->size;
+		link_count += chunk->link_count;
+	}
+
+	/* output that big is cut short the way a single pass cuts it */
+	if (link_count > 0 && (!exact || total > BUFFER_MAX_ALLOC_SIZE)) {
+		parallel_chunks_release(chunks, nchunks);
+		return rinku_autolink_with(ob, text, size, cfg, NULL, NULL);
+	}
+
+	if (link_count > 0) {
+		bufgrow(ob, ob->size + total);
+
+		for (i = 0; i < nchunks; ++i) {
+			struct parallel_chunk *chunk = &chunks[i];
+
+			if (chunk->link_count)
+				bufput(ob, chunk->ob->data, chunk->ob->size);
+			else
+				bufput(ob, text + chunk->start, chunk->end - chunk->start);
+		}
+	}
+
+	parallel_chunks_release(chunks, nchunks);
+	return link_count;
+}
+
+#ifdef RINKU_HAVE_FILES
+/*
+ * File to file autolinking. The input is mapped instead of read where
+ * possible, and only the markup of the links is built in memory: the
+ * text between links is written straight from the input with writev.
+ */
+
+/* spans passed to one writev, and the markup buffered before one is made */
+#define FILE_IOVS 64
+#define FILE_MARKUP_FLUSH (64 * 1024)
+
+/* The scanner can look a few bytes past the end of a truncated UTF-8
+ * sequence; the input is always followed by at least this many zeroes,
+ * like the terminator of a Ruby string */
+#define FILE_PADDING 8
+
+/* a span of the input, or of the markup buffer when `data` is NULL */
+struct file_span {
+	const uint8_t *data;
+	size_t offset;
+	size_t size;
+};
+
+struct file_out {
+	int fd;
+	struct buf *markup;
+	struct file_span spans[FILE_IOVS];
+	int count;
+};
+
+static int
+file_flush(struct file_out *out)
+{
+	struct iovec iov[FILE_IOVS], *next = iov;
+	int i, count = out->count;
+
+	for (i = 0; i < count; ++i) {
+		const struct file_span *span = &out->spans[i];
+		const uint8_t *base = span->data ? span->data : out->markup->data;
+
+		iov[i].iov_base = (void *)(base + span->offset);
+		iov[i].iov_len = span->size;
+	}
+
+	while (count > 0) {
+		ssize_t n = writev(out->fd, next, count);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (count > 0 && (size_t)n >= next->iov_len) {
+			n -= next->iov_len;
+			next++;
+			count--;
+		}
+
+		if (count > 0) {
+			next->iov_base = (char *)next->iov_base + n;
+			next->iov_len -= n;
+		}
+	}
+
+	out->count = 0;
+	out->markup->size = 0;
+	return 0;
+}
+
+/* Queues data[offset..offset + size); file_autolink makes sure there's room */
+static void
+file_put(struct file_out *out, const uint8_t *data, size_t offset, size_t size)
+{
+	struct file_span *span;
+
+	if (size == 0)
+		return;
+
+	/* markup written back to back goes out as one span */
+	if (data == NULL && out->count > 0) {
+		span = &out->spans[out->count - 1];
+
+		if (span->data == NULL && span->offset + span->size == offset) {
+			span->size += size;
+			return;
+		}
+	}
+
+	span = &out->spans[out->count++];
+	span->data = data;
+	span->offset = offset;
+	span->size = size;
+}
+
+/*
+ * Queues text[offset..offset + size). With RINKU_ESCAPE_HTML it's escaped
+ * into the markup buffer a piece at a time, flushing as it fills up; it
+ * always leaves room for one more span.
+ */
+static int
+file_put_text(struct file_out *out, const uint8_t *text,
+	size_t offset, size_t size, const struct rinku_config *cfg)
+{
+	if (!(cfg->flags & RINKU_ESCAPE_HTML)) {
+		file_put(out, text, offset, size);
+		return 0;
+	}
+
+	while (size > 0) {
+		const size_t piece = size < FILE_MARKUP_FLUSH ? size : FILE_MARKUP_FLUSH;
+		size_t mark;
+
+		if (out->count + 2 > FILE_IOVS || out->markup->size > FILE_MARKUP_FLUSH) {
+			if (file_flush(out) < 0)
+				return -1;
+		}
+
+		mark = out->markup->size;
+		if (bufgrow(out->markup, mark + 6 * piece) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		escape_html(out->markup, cfg, text + offset, piece);
+		file_put(out, NULL, mark, out->markup->size - mark);
+
+		offset += piece;
+		size -= piece;
+	}
+
+	return 0;
+}
+
+static int
+file_autolink(
+	struct file_out *out,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg)
+{
+	struct autolink_budget storage, *budget = autolink__budget(&storage, cfg);
+	struct autolink_pos link, href;
+	size_t i = 0, end = 0;
+	char action = 0;
+	int link_count = 0;
+
+	while (autolink__find(&link, &action, text, &end, i, size, size, cfg,
+			cfg->mode, budget)) {
+		const size_t link_len = link.end - link.start;
+		size_t mark;
+
+		/* every link queues the text before it and its markup */
+		if (out->count + 2 > FILE_IOVS || out->markup->size > FILE_MARKUP_FLUSH) {
+			if (file_flush(out) < 0)
+				return -1;
+		}
+
+		if (file_put_text(out, text, i, link.start - i, cfg) < 0)
+			return -1;
+
+		mark = out->markup->size;
+		if (bufgrow(out->markup, mark + 12 * link_len + cfg->link_attr_size + 32) < 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		autolink__open_tag(out->markup, text + link.start, link_len,
+			action, cfg, cfg->link_attr != NULL, &href);
+		autolink__link_text(out->markup, text + link.start, link_len, cfg, &href);
+		BUFPUTSL(out->markup, "</a>");
+
+		file_put(out, NULL, mark, out->markup->size - mark);
+
+		link_count++;
+		i = link.end;
+	}
+
+	if (out->count == FILE_IOVS && file_flush(out) < 0)
+		return -1;
+
+	if (file_put_text(out, text, i, size - i, cfg) < 0)
+		return -1;
+
+	if (file_flush(out) < 0)
+		return -1;
+
+	return link_count;
+}
+
+/*
+ * Maps `size` bytes of `fd` over a zeroed anonymous mapping one page
+ * longer, which pads the end of the input. NULL if it can't be mapped.
+ */
+static uint8_t *
+file_map(int fd, size_t size, size_t *mapped)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t len;
+	void *base;
+
+	if (size > SIZE_MAX - 2 * page)
+		return NULL;
+
+	len = (size + page - 1) / page * page + page;
+	base = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, len);
+		return NULL;
+	}
+
+#ifdef MADV_SEQUENTIAL
+	madvise(base, size, MADV_SEQUENTIAL);
+#endif
+
+	*mapped = len;
+	return base;
+#else
+	return NULL;
+#endif
+}
+
+/* Reads all of `fd` into a padded heap block, for inputs that can't be mapped */
+static uint8_t *
+file_read(int fd, size_t *size)
+{
+	size_t asize = 64 * 1024, len = 0;
+	uint8_t *data = malloc(asize);
+
+	while (data != NULL) {
+		ssize_t n;
+
+		if (asize - len < FILE_PADDING + 1) {
+			uint8_t *grown = asize <= SIZE_MAX / 2 ? realloc(data, asize * 2) : NULL;
+
+			if (grown == NULL) {
+				free(data);
+				errno = ENOMEM;
+				return NULL;
+			}
+
+			data = grown;
+			asize *= 2;
+		}
+
+		n = read(fd, data + len, asize - len - FILE_PADDING);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(data);
+			return NULL;
+		}
+
+		if (n == 0) {
+			memset(data + len, 0, FILE_PADDING);
+			*size = len;
+			return data;
+		}
+
+		len += n;
+	}
+
+	errno = ENOMEM;
+	return NULL;
+}
+
+/*
+ * Whether text[0..size) is well-formed UTF-8 the way Ruby checks it, so
+ * a file is refused exactly when the same text in a String would be:
+ * no overlong forms, surrogates, or code points past U+10FFFF
+ */
+static bool
+file_valid_utf8(const uint8_t *text, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size) {
+		const uint8_t c = text[i];
+		uint8_t lo = 0x80, hi = 0xBF;
+		size_t len, n;
+
+		if (c < 0x80) {
+			i = rinku_scan_ascii(text, i, size);
+			continue;
+		}
+
+		if (c >= 0xC2 && c <= 0xDF)
+			len = 2;
+		else if (c >= 0xE0 && c <= 0xEF)
+			len = 3;
+		else if (c >= 0xF0 && c <= 0xF4)
+			len = 4;
+		else
+			return false;
+
+		if (c == 0xE0)
+			lo = 0xA0;
+		else if (c == 0xED)
+			hi = 0x9F;
+		else if (c == 0xF0)
+			lo = 0x90;
+		else if (c == 0xF4)
+			hi = 0x8F;
+
+		if (len > size - i || text[i + 1] < lo || text[i + 1] > hi)
+			return false;
+
+		for (n = 2; n < len; ++n) {
+			if ((text[i + n] & 0xC0) != 0x80)
+				return false;
+		}
+
+		i += len;
+	}
+
+	return true;
+}
+
+int
+rinku_autolink_fd(int in_fd, int out_fd, const struct rinku_config *cfg)
+{
+	struct file_out out;
+	struct stat st;
+	size_t size = 0, mapped = 0;
+	uint8_t *text = NULL;
+	int link_count, saved;
+
+	if (fstat(in_fd, &st) < 0)
+		return -1;
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+		(uint64_t)st.st_size <= SIZE_MAX) {
+		size = (size_t)st.st_size;
+		text = file_map(in_fd, size, &mapped);
+	}
+
+	if (text == NULL) {
+		text = file_read(in_fd, &size);
+		if (text == NULL)
+			return -1;
+	}
+
+	out.fd = out_fd;
+	out.count = 0;
+	out.markup = NULL;
+
+	/* checked in full first, so nothing is written for bad input */
+	if (!file_valid_utf8(text, size)) {
+		link_count = -1;
+		errno = EILSEQ;
+	} else if ((out.markup = bufpool_get(FILE_MARKUP_FLUSH)) == NULL) {
+		link_count = -1;
+		errno = ENOMEM;
+	} else {
+		link_count = file_autolink(&out, text, size, cfg);
+	}
+
+	saved = errno;
+	bufpool_put(out.markup);
+
+#ifdef HAVE_SYS_MMAN_H
+	if (mapped)
+		munmap(text, mapped);
+	else
+#endif
+		free(text);
+
+	errno = saved;
+	return link_count;
+}
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* how many names rinku_output_open tries for its temporary file */
+#define OUTPUT_TMP_TRIES 100
+
+int
+rinku_output_open(struct rinku_output *out, const char *path)
+{
+	struct stat st;
+	bool exists;
+	size_t len;
+	int i, saved;
+
+	out->fd = -1;
+	out->path = NULL;
+	out->tmp_path = NULL;
+
+	exists = stat(path, &st) == 0;
+
+	/* pipes and devices can't be replaced, only written to */
+	if (exists && !S_ISREG(st.st_mode)) {
+		out->fd = open(path, O_WRONLY | O_CLOEXEC);
+		return out->fd < 0 ? -1 : 0;
+	}
+
+	/* through symlinks, so it's the file they point to that's replaced */
+	out->path = exists ? realpath(path, NULL) : strdup(path);
+	if (out->path == NULL)
+		return -1;
+
+	len = strlen(out->path) + 32;
+	out->tmp_path = malloc(len);
+	if (out->tmp_path == NULL) {
+		free(out->path);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < OUTPUT_TMP_TRIES; ++i) {
+		snprintf(out->tmp_path, len, "%s.%ld-%d.tmp", out->path, (long)getpid(), i);
+
+		out->fd = open(out->tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (out->fd >= 0 || errno != EEXIST)
+			break;
+	}
+
+	if (out->fd < 0) {
+		saved = errno;
+		free(out->path);
+		free(out->tmp_path);
+		errno = saved;
+		return -1;
+	}
+
+	/* a replaced file keeps its permissions; a new one gets the umask's */
+	if (exists)
+		(void)fchmod(out->fd, st.st_mode & 07777);
+
+	return 0;
+}
+
+int
+rinku_output_close(struct rinku_output *out, bool keep)
+{
+	int error = close(out->fd) < 0 ? errno : 0;
+
+	if (out->tmp_path) {
+		if (keep && error == 0 && rename(out->tmp_path, out->path) < 0)
+			error = errno;
+
+		if (!keep || error)
+			unlink(out->tmp_path);
+	}
+
+	free(out->path);
+	free(out->tmp_path);
+	out->fd = -1;
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
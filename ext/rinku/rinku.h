@@ -1,8 +1,15 @@
 #ifndef _RINKU_H
 #define _RINKU_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "buffer.h"
+#include "autolink.h"
+#include "scan.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef enum {
 	AUTOLINK_URLS = (1 << 0),
@@ -10,7 +17,180 @@ typedef enum {
 	AUTOLINK_ALL = AUTOLINK_URLS|AUTOLINK_EMAILS
 } autolink_mode;
 
-int
+/* rinku_link_kind: which detector found a link; `www.` links have no
+ * protocol in the text and are linked as `http://` */
+typedef enum {
+	RINKU_LINK_WWW = 1,
+	RINKU_LINK_EMAIL,
+	RINKU_LINK_URL
+} rinku_link_kind;
+
+/* struct rinku_link: a link found by rinku_extract_links, as byte
+ * offsets into the text */
+struct rinku_link {
+	size_t start;
+	size_t end;
+	rinku_link_kind kind;
+};
+
+/* struct rinku_links: a growable array of links, which the functions
+ * that find them append to. Start it zeroed and free it with
+ * rinku_links_free. */
+struct rinku_links {
+	struct rinku_link *data;
+	size_t count;
+	size_t asize;
+};
+
+/*
+ * RINKU_ESCAPE_HTML: a config flag for text that isn't HTML yet. It's
+ * escaped as it's written out, the way Rails' `h` escapes it, links are
+ * found in the unescaped text and end where they would in the escaped
+ * one (except at a raw `<`, which ends them where `&lt;` wouldn't), and
+ * there are no tags to skip. Texts with something to escape
+ * are written out even if they have no links, so check whether the
+ * output grew rather than the link count. A link text callback gets the
+ * unescaped link and must escape what it writes.
+ */
+#define RINKU_ESCAPE_HTML AUTOLINK_RAW_TEXT
+
+/* RINKU_SKIP_SLOTS: size of the skip tag hash table (a power of two);
+ * lists with more than half as many tags are matched linearly */
+#define RINKU_SKIP_SLOTS 64
+
+/*
+ * struct rinku_config: everything rinku_autolink derives from its options,
+ * computed once so it can be reused across calls. The config points into
+ * `link_attr`, `skip_tags` and the URL schemes, which must outlive it, and
+ * it must not be copied once initialized.
+ */
+struct rinku_config {
+	autolink_mode mode;
+	unsigned int flags;
+	const char *link_attr;
+	size_t link_attr_size;
+	const char **skip_tags;
+	struct {
+		const char *name;
+		size_t size;
+	} skip_slots[RINKU_SKIP_SLOTS];
+	size_t skip_max_size;
+	bool skip_linear;
+	struct autolink_schemes schemes;
+	size_t max_links;
+	size_t max_work;
+	char active_chars[256];
+	struct rinku_scan_set triggers;
+	struct rinku_scan_set escapes;
+};
+
+RINKU_API void
+rinku_config_init(
+	struct rinku_config *cfg,
+	autolink_mode mode,
+	unsigned int flags,
+	const char *link_attr,
+	const char **skip_tags);
+
+/* rinku_config_set_schemes: replaces the URL schemes that are linked, a
+ * NULL-terminated list of names such as "http"; NULL restores the default
+ * of http, https and ftp */
+RINKU_API void
+rinku_config_set_schemes(struct rinku_config *cfg, const char **schemes);
+
+/*
+ * rinku_config_set_budget: caps what each call with this config can
+ * spend, 0 meaning no limit: `max_links` links, and `max_work` bytes
+ * read by the link detectors, which is what hostile input inflates.
+ * Once either runs out the rest of the text is passed through as-is.
+ * Streams spend one budget over the whole document.
+ */
+RINKU_API void
+rinku_config_set_budget(struct rinku_config *cfg, size_t max_links, size_t max_work);
+
+RINKU_API int
+rinku_autolink_with(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload);
+
+/* rinku_autolink_limited: rinku_autolink_with, setting `*truncated` when
+ * the budget of the config ran out before the end of the text */
+RINKU_API int
+rinku_autolink_limited(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload,
+	bool *truncated);
+
+/*
+ * rinku_extract_links: finds the links rinku_autolink_with would make,
+ * without writing any output, and appends them to `links`. Returns the
+ * number of links found, or -1 with errno set if they don't fit in
+ * memory or in an int; the links already appended are kept.
+ */
+RINKU_API int
+rinku_extract_links(
+	struct rinku_links *links,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg);
+
+/*
+ * rinku_extract_links_edit: the links of a text after an edit, given the
+ * links rinku_extract_links found in it before, with the same config.
+ * The edit replaced the bytes in [edit_start, edit_old_end) of the old
+ * text with [edit_start, edit_new_end) of the new one. The scan starts
+ * again at the whitespace before the edit, once past the tags between it
+ * and the last link before that. It stops at the next whitespace or '<'
+ * after inserted text, and otherwise at the first link that is where it
+ * was, which may be the end of the text: there's no telling what tags
+ * the removed text opened or closed. The other links are copied over.
+ * The text must be valid UTF-8.
+ * Returns the number of links, or -1 with errno set: EINVAL if the links
+ * or the edit don't fit the text, and otherwise as rinku_extract_links.
+ */
+RINKU_API int
+rinku_extract_links_edit(
+	struct rinku_links *links,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	const struct rinku_link *old_links,
+	size_t old_count,
+	size_t edit_start,
+	size_t edit_old_end,
+	size_t edit_new_end);
+
+/* rinku_links_free: frees the links of an array and zeroes it */
+RINKU_API void
+rinku_links_free(struct rinku_links *links);
+
+/*
+ * rinku_render_links: writes what rinku_autolink_with would for a text
+ * whose links are already known, without scanning it. Like it, nothing
+ * is written when there are no links and nothing to escape. Returns the
+ * number of links, or -1 if they're out of order or past the end of the
+ * text.
+ */
+RINKU_API int
+rinku_render_links(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	const struct rinku_link *links,
+	size_t count,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload);
+
+RINKU_API int
 rinku_autolink(
 	struct buf *ob,
 	const uint8_t *text,
@@ -21,5 +201,106 @@ rinku_autolink(
 	const char **skip_tags,
 	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
 	void *payload);
-	
+
+/* RINKU_PARALLEL_MAX_THREADS: most threads rinku_autolink_parallel uses;
+ * RINKU_PARALLEL_MIN_CHUNK: least text it gives each of them */
+#define RINKU_PARALLEL_MAX_THREADS 32
+#ifndef RINKU_PARALLEL_MIN_CHUNK
+#define RINKU_PARALLEL_MIN_CHUNK (256 * 1024)
+#endif
+
+/*
+ * rinku_autolink_parallel: same output and count as rinku_autolink_with
+ * without a link text callback, splitting the text into chunks that are
+ * autolinked on up to `threads` threads at once. Texts too small to split
+ * are linked on the calling thread, as are all of them when built without
+ * pthreads or with a config that has a budget. The other threads are a
+ * pool, started as calls first need them and kept for the whole process.
+ */
+RINKU_API int
+rinku_autolink_parallel(
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size,
+	const struct rinku_config *cfg,
+	int threads);
+
+/*
+ * struct rinku_stream: autolinks a document that arrives in pieces, with
+ * the same results as autolinking it in one go. Input is held back only
+ * until the next point where it's safe to write it out (usually the next
+ * whitespace outside of a tag), and never more than 64KB of it: a longer
+ * run without one of those points is cut short, splitting any link that
+ * crosses the cut. The config must outlive the stream.
+ */
+struct rinku_stream;
+
+RINKU_API struct rinku_stream *
+rinku_stream_new(
+	const struct rinku_config *cfg,
+	void (*link_text_cb)(struct buf *, const uint8_t *, size_t, void *),
+	void *payload);
+
+/* rinku_stream_feed: appends the next piece of the document, writing
+ * whatever output is ready to `ob`; returns the number of links written,
+ * or -1 with errno set if the pending text can't be held */
+RINKU_API int
+rinku_stream_feed(
+	struct rinku_stream *st,
+	struct buf *ob,
+	const uint8_t *text,
+	size_t size);
+
+/* rinku_stream_finish: writes out the rest of the document and resets the
+ * stream for the next one; returns the number of links in the document */
+RINKU_API int
+rinku_stream_finish(struct rinku_stream *st, struct buf *ob);
+
+RINKU_API void
+rinku_stream_free(struct rinku_stream *st);
+
+/* RINKU_HAVE_FILES: rinku_autolink_fd is built (it needs unistd.h and
+ * sys/uio.h) */
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_UIO_H)
+#define RINKU_HAVE_FILES 1
+#endif
+
+/*
+ * rinku_autolink_fd: autolinks everything read from `in_fd` and writes
+ * the result to `out_fd`, without holding a copy of either in memory
+ * when the input is a regular file, which must not be truncated while
+ * it's being linked. Input that isn't valid UTF-8 fails with EILSEQ
+ * before anything is written. Returns the number of links, or -1 with
+ * errno set; output written before a failure is left to the caller, who
+ * can write into a rinku_output to have it dropped.
+ */
+RINKU_API int
+rinku_autolink_fd(int in_fd, int out_fd, const struct rinku_config *cfg);
+
+/*
+ * struct rinku_output: an output file that is only replaced once it's
+ * complete. A regular file (or one that doesn't exist yet) is written to
+ * a temporary file next to it, which rinku_output_close renames over it,
+ * so a failure leaves it as it was. Pipes and devices are written to
+ * directly.
+ */
+struct rinku_output {
+	int fd;
+	char *path;
+	char *tmp_path;
+};
+
+/* rinku_output_open: -1 with errno set if `path` can't be written */
+RINKU_API int
+rinku_output_open(struct rinku_output *out, const char *path);
+
+/* rinku_output_close: closes the output, putting it in place if `keep`
+ * and dropping it otherwise; -1 with errno set if it can't be kept */
+RINKU_API int
+rinku_output_close(struct rinku_output *out, bool keep);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -14,22 +14,186 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <stdio.h>
+#include <time.h>
 
 #define RUBY_EXPORT __attribute__ ((visibility ("default")))
 
 #include <ruby.h>
 #include <ruby/encoding.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
 
 #include "rinku.h"
 #include "autolink.h"
+#include "cache.h"
+#include "stats.h"
+#include "utf8.h"
+
+#ifdef RINKU_HAVE_FILES
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * Inputs at least this large are autolinked with the GVL released
+ * (unless a block is given, because the block needs to run in Ruby)
+ */
+#define RINKU_NOGVL_THRESHOLD (64 * 1024)
 
 static VALUE rb_mRinku;
+static VALUE rb_cLinker;
+static VALUE rb_cStream;
 
+static ID id_all, id_email_addresses, id_urls, id_call;
+static ID id_link_kinds[4];
+
+static const char *SKIP_TAGS[] = {"a", "pre", "code", "kbd", "script", NULL};
+
+/* The config `auto_link` uses with all of its defaults. It's built once
+ * by Init_rinku and only read afterwards, so every Ractor shares it. */
+static struct rinku_config g_default_config;
+
+/*
+ * `rb_text` is the frozen text being linked; the block gets substrings
+ * that share its bytes, frozen ones with `frozen_links`.
+ */
 struct callback_data {
 	VALUE rb_block;
+	VALUE rb_text;
+	rb_encoding *encoding;
+	bool frozen_links;
+};
+
+struct autolink_args {
+	struct buf *ob;
+	const uint8_t *text;
+	size_t size;
+	const struct rinku_config *cfg;
+	int threads;
+	int count;
+	bool truncated;
+};
+
+struct extract_args {
+	struct rinku_links links;
+	const uint8_t *text;
+	size_t size;
+	const struct rinku_config *cfg;
+	int count, error;
+};
+
+struct file_args {
+	int in_fd, out_fd;
+	const struct rinku_config *cfg;
+	int count;
+	int error;
+};
+
+/*
+ * Batched calls stop to hand their results back to Ruby whenever the
+ * shared output buffer grows past this size
+ */
+#define RINKU_BATCH_FLUSH_SIZE (4 * 1024 * 1024)
+
+struct batch_item {
+	const uint8_t *text;
+	size_t size;
+	size_t out_start;
+	size_t out_size;
+	int count;
+};
+
+struct batch_args {
+	struct buf *ob;
+	struct batch_item *items;
+	long next, count;
+	const struct rinku_config *cfg;
+};
+
+/* Rinku::Linker: a rinku_config that owns copies of its strings */
+struct rinku_linker {
+	struct rinku_config config;
+	char *link_attr;
+	char **skip_tags;
+	char **schemes;
+	bool frozen_links;
+	int threads;
+	bool ready;
+};
+
+/* Rinku::Stream: a rinku_stream reading the config of a Rinku::Linker */
+struct rinku_linker_stream {
+	VALUE rb_linker;
+	struct rinku_stream *stream;
 	rb_encoding *encoding;
 };
 
+static void *
+autolink_nogvl(void *data)
+{
+	struct autolink_args *args = data;
+
+	/* linkers with a budget always have a single thread */
+	if (args->threads > 1)
+		args->count = rinku_autolink_parallel(
+			args->ob, args->text, args->size, args->cfg, args->threads);
+	else
+		args->count = rinku_autolink_limited(args->ob, args->text,
+			args->size, args->cfg, NULL, NULL, &args->truncated);
+
+	return NULL;
+}
+
+static void *
+extract_nogvl(void *data)
+{
+	struct extract_args *args = data;
+
+	args->count = rinku_extract_links(&args->links, args->text, args->size, args->cfg);
+	if (args->count < 0)
+		args->error = errno;
+
+	return NULL;
+}
+
+#ifdef RINKU_HAVE_FILES
+static void *
+autolink_file_nogvl(void *data)
+{
+	struct file_args *args = data;
+
+	args->count = rinku_autolink_fd(args->in_fd, args->out_fd, args->cfg);
+	args->error = errno;
+
+	return NULL;
+}
+#endif
+
+/*
+ * Autolinks batch items into the shared output buffer, one after the
+ * other, until the batch is done or the buffer needs flushing
+ */
+static void *
+autolink_batch_nogvl(void *data)
+{
+	struct batch_args *args = data;
+
+	while (args->next < args->count &&
+		args->ob->size < RINKU_BATCH_FLUSH_SIZE) {
+		struct batch_item *item = &args->items[args->next++];
+
+		item->out_start = args->ob->size;
+		item->count = rinku_autolink_with(args->ob,
+			item->text, item->size, args->cfg, NULL, NULL);
+		item->out_size = args->ob->size - item->out_start;
+	}
+
+	return NULL;
+}
+
 static rb_encoding *
 validate_encoding(VALUE rb_str)
 {
@@ -48,6 +212,16 @@ validate_encoding(VALUE rb_str)
 	return encoding;
 }
 
+#ifdef RINKU_STATS
+static uint64_t
+stats_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
 static void
 autolink_callback(struct buf *link_text,
 		const uint8_t *url, size_t url_len, void *block)
@@ -55,185 +229,1700 @@ autolink_callback(struct buf *link_text,
 	struct callback_data *data = block;
 	VALUE rb_link, rb_link_text;
 
-	rb_link = rb_enc_str_new((const char *)url, url_len, data->encoding);
-	rb_link_text = rb_funcall(data->rb_block,
-			rb_intern("call"), 1, rb_link);
+#ifdef RINKU_STATS
+	uint64_t started = stats_clock();
+#endif
+
+	rb_link = rb_str_subseq(data->rb_text,
+		(const char *)url - RSTRING_PTR(data->rb_text), url_len);
+
+	if (data->frozen_links)
+		rb_obj_freeze(rb_link);
 
-	if (validate_encoding(rb_link_text) != data->encoding)
+	if (rb_obj_is_proc(data->rb_block))
+		rb_link_text = rb_proc_call_with_block(data->rb_block, 1, &rb_link, Qnil);
+	else
+		rb_link_text = rb_funcall(data->rb_block, id_call, 1, rb_link);
+
+#ifdef RINKU_STATS
+	RINKU_STAT(callback_ns, stats_clock() - started);
+#endif
+
+	/* a frozen link given back as-is is still a valid piece of the text */
+	if (!(data->frozen_links && rb_link_text == rb_link) &&
+		validate_encoding(rb_link_text) != data->encoding)
 		rb_raise(rb_eArgError, "encoding mismatch");
 
 	bufput(link_text, RSTRING_PTR(rb_link_text), RSTRING_LEN(rb_link_text));
 }
 
-const char **rinku_load_tags(VALUE rb_skip)
+static bool
+autolink_use_nogvl(VALUE rb_text, VALUE rb_block)
 {
-	const char **skip_tags;
-	size_t i, count;
+	return !RTEST(rb_block) && RSTRING_LEN(rb_text) >= RINKU_NOGVL_THRESHOLD;
+}
 
-	Check_Type(rb_skip, T_ARRAY);
+static int
+parse_mode(VALUE rb_mode)
+{
+	ID mode_sym;
 
-	count = RARRAY_LEN(rb_skip);
-	skip_tags = xmalloc(sizeof(void *) * (count + 1));
+	if (NIL_P(rb_mode))
+		return AUTOLINK_ALL;
 
-	for (i = 0; i < count; ++i) {
-		VALUE tag = rb_ary_entry(rb_skip, i);
-		Check_Type(tag, T_STRING);
-		skip_tags[i] = StringValueCStr(tag);
+	Check_Type(rb_mode, T_SYMBOL);
+
+	mode_sym = SYM2ID(rb_mode);
+	if (mode_sym == id_all)
+		return AUTOLINK_ALL;
+	else if (mode_sym == id_email_addresses)
+		return AUTOLINK_EMAILS;
+	else if (mode_sym == id_urls)
+		return AUTOLINK_URLS;
+
+	rb_raise(rb_eTypeError,
+		"Invalid linking mode "
+		"(possible values are :all, :urls, :email_addresses)");
+}
+
+static unsigned int
+parse_flags(VALUE rb_flags)
+{
+	if (NIL_P(rb_flags))
+		return 0;
+
+	Check_Type(rb_flags, T_FIXNUM);
+	return FIX2INT(rb_flags);
+}
+
+/* Finished outputs shorter than this are copied to drop their slack;
+ * rb_str_resize leaves at most 1KB on longer ones */
+#define RSTRING_COPY_MAX (8 * 1024)
+
+/* RINKU_STREAM_SLICE: the most text Rinku::Stream#feed hands to the
+ * stream at once */
+#define RINKU_STREAM_SLICE (1024 * 1024)
+
+/*
+ * An output buffer that grows a Ruby String in place, so the result is
+ * built in its final allocation instead of being copied out of a malloc'd
+ * one. The string is only created when the first byte is written, with
+ * the capacity the autolinker estimates for the whole output. Scans that
+ * release the GVL take it back just to grow the string.
+ */
+struct rstring_output {
+	struct buf ob;
+	VALUE rb_str;
+	rb_encoding *encoding;
+	bool nogvl;
+	size_t size;
+	int error;
+};
+
+static VALUE
+rstring_output_resize(VALUE data)
+{
+	struct rstring_output *out = (struct rstring_output *)data;
+
+	if (NIL_P(out->rb_str)) {
+		out->rb_str = rb_str_buf_new(out->size);
+		rb_enc_associate(out->rb_str, out->encoding);
+	} else {
+		rb_str_set_len(out->rb_str, out->ob.size);
+		rb_str_modify_expand(out->rb_str, out->size - out->ob.size);
 	}
 
-	skip_tags[count] = NULL;
-	return skip_tags;
+	return Qnil;
+}
+
+static void *
+rstring_output_resize_gvl(void *data)
+{
+	struct rstring_output *out = data;
+
+	rb_protect(rstring_output_resize, (VALUE)out, &out->error);
+	return out->error ? NULL : RSTRING_PTR(out->rb_str);
+}
+
+static void *
+rstring_output_grow(struct buf *ob, size_t size)
+{
+	struct rstring_output *out = ob->opaque;
+
+	/* a failed resize without the GVL is raised once the scan is over */
+	if (out->error)
+		return NULL;
+
+	out->size = size;
+
+	if (out->nogvl)
+		return rb_thread_call_with_gvl(rstring_output_resize_gvl, out);
+
+	rstring_output_resize((VALUE)out);
+	return RSTRING_PTR(out->rb_str);
+}
+
+static void
+rstring_output_init(struct rstring_output *out, rb_encoding *encoding, bool nogvl)
+{
+	out->ob.data = NULL;
+	out->ob.size = out->ob.asize = 0;
+	out->ob.unit = 32;
+	out->ob.grow = &rstring_output_grow;
+	out->ob.opaque = out;
+	out->rb_str = Qnil;
+	out->encoding = encoding;
+	out->nogvl = nogvl;
+	out->error = 0;
 }
 
 /*
- * Document-method: auto_link
- *
- * call-seq:
- *  auto_link(text, mode=:all, link_attr=nil, skip_tags=nil, flags=0)
- *  auto_link(text, mode=:all, link_attr=nil, skip_tags=nil, flags=0) { |link_text| ... }
- *
- * Parses a block of text looking for "safe" urls or email addresses,
- * and turns them into HTML links with the given attributes.
- *
- * NOTE: The block of text may or may not be HTML; if the text is HTML,
- * Rinku will skip the relevant tags to prevent double-linking and linking
- * inside `pre` blocks by default.
- *
- * NOTE: If the input text is HTML, it's expected to be already escaped.
- * Rinku will perform no escaping.
- *
- * NOTE: Currently the follow protocols are considered safe and are the
- * only ones that will be autolinked.
- *
- *     http:// https:// ftp:// mailto://
- *
- * Email addresses are also autolinked by default. URLs without a protocol
- * specifier but starting with 'www.' will also be autolinked, defaulting to
- * the 'http://' protocol.
- *
- * -   `text` is a string in plain text or HTML markup. If the string is formatted in
- * HTML, Rinku is smart enough to skip the links that are already enclosed in `<a>`
- * tags.`
- *
- * -   `mode` is a symbol, either `:all`, `:urls` or `:email_addresses`, 
- * which specifies which kind of links will be auto-linked. 
- *
- * -   `link_attr` is a string containing the link attributes for each link that
- * will be generated. These attributes are not sanitized and will be include as-is
- * in each generated link, e.g.
- *
- *      ~~~~~ruby
- *      auto_link('http://www.pokemon.com', :all, 'target="_blank"')
- *      # => '<a href="http://www.pokemon.com" target="_blank">http://www.pokemon.com</a>'
- *      ~~~~~
- *
- *     This string can be autogenerated from a hash using the Rails `tag_options` helper.
- *
- * -   `skip_tags` is a list of strings with the names of HTML tags that will be skipped
- * when autolinking. If `nil`, this defaults to the value of the global `Rinku.skip_tags`,
- * which is initially `["a", "pre", "code", "kbd", "script"]`.
- *
- * -   `flag` is an optional boolean value specifying whether to recognize
- * 'http://foo' as a valid domain, or require at least one '.'. It defaults to false.
- *
- * -   `&block` is an optional block argument. If a block is passed, it will
- * be yielded for each found link in the text, and its return value will be used instead
- * of the name of the link. E.g.
- *
- *     ~~~~~ruby
- *     auto_link('Check it out at http://www.pokemon.com') do |url|
- *       "THE POKEMAN WEBSITEZ"
- *     end
- *     # => 'Check it out at <a href="http://www.pokemon.com">THE POKEMAN WEBSITEZ</a>'
- *     ~~~~~~
+ * Returns the finished output string, or raises what failed to grow it.
+ * Results are often kept, so they don't hold on to the slack left by
+ * growing them: rb_str_resize gives large strings back their slack, and
+ * small ones, which it leaves alone, are copied into one of their size.
  */
 static VALUE
-rb_rinku_autolink(int argc, VALUE *argv, VALUE self)
+rstring_output_finish(struct rstring_output *out)
 {
-	static const char *SKIP_TAGS[] = {"a", "pre", "code", "kbd", "script", NULL};
+	const size_t size = out->ob.size;
 
-	VALUE result, rb_text, rb_mode, rb_html, rb_skip, rb_flags, rb_block;
-	rb_encoding *text_encoding;
-	struct buf *output_buf;
-	int link_mode = AUTOLINK_ALL, count;
-	unsigned int link_flags = 0;
-	const char *link_attr = NULL;
-	const char **skip_tags = NULL;
-	struct callback_data cbdata;
+	if (out->error)
+		rb_jump_tag(out->error);
 
-	rb_scan_args(argc, argv, "14&", &rb_text, &rb_mode,
-		&rb_html, &rb_skip, &rb_flags, &rb_block); 
+	if (NIL_P(out->rb_str))
+		return rb_enc_str_new(NULL, 0, out->encoding);
 
-	text_encoding = validate_encoding(rb_text);
+	rb_str_set_len(out->rb_str, size);
 
-	if (!NIL_P(rb_mode)) {
-		ID mode_sym;
-		Check_Type(rb_mode, T_SYMBOL);
-
-		mode_sym = SYM2ID(rb_mode);
-		if (mode_sym == rb_intern("all"))
-			link_mode = AUTOLINK_ALL;
-		else if (mode_sym == rb_intern("email_addresses"))
-			link_mode = AUTOLINK_EMAILS;
-		else if (mode_sym == rb_intern("urls"))
-			link_mode = AUTOLINK_URLS;
-		else
-			rb_raise(rb_eTypeError,
-				"Invalid linking mode "
-				"(possible values are :all, :urls, :email_addresses)");
-	}
+	if (rb_str_capacity(out->rb_str) - size <= size / 8)
+		return out->rb_str;
 
-	if (!NIL_P(rb_html)) {
-		Check_Type(rb_html, T_STRING);
-		link_attr = RSTRING_PTR(rb_html);
+	if (size < RSTRING_COPY_MAX)
+		return rb_enc_str_new(RSTRING_PTR(out->rb_str), (long)size, out->encoding);
+
+	rb_str_resize(out->rb_str, (long)size);
+	return out->rb_str;
+}
+
+struct cache_copy {
+	const struct rinku_cache_hit *hit;
+	rb_encoding *encoding;
+};
+
+static VALUE
+cache_copy_body(VALUE arg)
+{
+	const struct cache_copy *copy = (const struct cache_copy *)arg;
+
+	return rb_enc_str_new((const char *)copy->hit->output,
+		(long)copy->hit->output_size, copy->encoding);
+}
+
+/* The cached result of autolinking `rb_text`, or Qundef. The entry is
+ * pinned rather than locked while the String is made from it, so nothing
+ * that could start a GC runs with the cache's lock held, and it's always
+ * released, even when that raises. */
+static VALUE
+autolink_cached(VALUE rb_text, rb_encoding *text_encoding,
+	const struct rinku_cache_key *key)
+{
+	struct rinku_cache_hit hit;
+	struct cache_copy copy;
+	VALUE result = rb_text;
+	int error = 0;
+
+	if (!rinku_cache_get(key, (const uint8_t *)RSTRING_PTR(rb_text),
+		(size_t)RSTRING_LEN(rb_text), &hit))
+		return Qundef;
+
+	if (hit.output_size > 0) {
+		copy.hit = &hit;
+		copy.encoding = text_encoding;
+		result = rb_protect(cache_copy_body, (VALUE)&copy, &error);
 	}
 
-	if (!NIL_P(rb_flags)) {
-		Check_Type(rb_flags, T_FIXNUM);
-		link_flags = FIX2INT(rb_flags);
+	rinku_cache_release(&hit);
+
+	if (error)
+		rb_jump_tag(error);
+
+	return result;
+}
+
+/*
+ * Autolinks `rb_text` with a ready config. The GVL is released for large
+ * inputs, in which case the config must not reference any Ruby memory
+ * that other threads could modify, and they're split over up to `threads`
+ * threads. `*truncated` is set when the config's budget ran out.
+ */
+static VALUE
+autolink_run(VALUE rb_text, rb_encoding *text_encoding,
+	const struct rinku_config *cfg, VALUE rb_block, bool frozen_links,
+	int threads, bool *truncated)
+{
+	VALUE result, rb_pinned_text = rb_text;
+	struct rstring_output output;
+	struct buf *output_buf = &output.ob;
+	bool nogvl = autolink_use_nogvl(rb_text, rb_block);
+	bool cached = NIL_P(rb_block) && rinku_cache_capacity() > 0;
+	struct rinku_cache_key cache_key;
+	int count;
+
+	*truncated = false;
+
+	/* calls with a block are never cached: the block could return
+	 * something else every time */
+	if (cached)
+		cached = rinku_cache_key_init(&cache_key, cfg);
+
+	if (cached) {
+		result = autolink_cached(rb_text, text_encoding, &cache_key);
+
+		if (result != Qundef)
+			return result;
 	}
 
-	if (NIL_P(rb_skip))
-		rb_skip = rb_iv_get(self, "@skip_tags");
+	rstring_output_init(&output, text_encoding, nogvl);
 
-	if (NIL_P(rb_skip)) {
-		skip_tags = SKIP_TAGS;
+	if (nogvl) {
+		struct autolink_args args;
+
+		rb_pinned_text = rb_str_new_frozen(rb_text);
+
+		args.ob = output_buf;
+		args.text = (const uint8_t *)RSTRING_PTR(rb_pinned_text);
+		args.size = (size_t)RSTRING_LEN(rb_pinned_text);
+		args.cfg = cfg;
+		args.threads = threads;
+
+		rb_thread_call_without_gvl(autolink_nogvl, &args, NULL, NULL);
+		count = args.count;
+		*truncated = args.truncated;
 	} else {
-		skip_tags = rinku_load_tags(rb_skip);
+		struct callback_data cbdata;
+
+		/* pinned so the block can't modify the text halfway through,
+		 * and so the links it gets can share the text's bytes */
+		if (RTEST(rb_block))
+			rb_pinned_text = rb_str_new_frozen(rb_text);
+
+		cbdata.rb_block = rb_block;
+		cbdata.rb_text = rb_pinned_text;
+		cbdata.encoding = text_encoding;
+		cbdata.frozen_links = frozen_links;
+		count = rinku_autolink_limited(
+			output_buf,
+			(const uint8_t *)RSTRING_PTR(rb_pinned_text),
+			(size_t)RSTRING_LEN(rb_pinned_text),
+			cfg,
+			RTEST(rb_block) ? &autolink_callback : NULL,
+			(void*)&cbdata,
+			truncated);
 	}
 
-	output_buf = bufnew(32);
-	cbdata.rb_block = rb_block;
-	cbdata.encoding = text_encoding;
-	count = rinku_autolink(
-		output_buf,
-		(const uint8_t *)RSTRING_PTR(rb_text),
-		(size_t)RSTRING_LEN(rb_text),
-		link_mode,
-		link_flags,
-		link_attr,
-		skip_tags,
-		RTEST(rb_block) ? &autolink_callback : NULL,
-		(void*)&cbdata);
-
-	if (count == 0)
+	/* nothing is written for texts that come out unchanged */
+	if (NIL_P(output.rb_str) && !output.error)
 		result = rb_text;
-	else {
-		result = rb_enc_str_new((char *)output_buf->data, output_buf->size,
-			text_encoding);
+	else
+		result = rstring_output_finish(&output);
+
+	/* only complete results are cached, so hits are never truncated */
+	if (cached && !*truncated)
+		rinku_cache_put(&cache_key,
+			(const uint8_t *)RSTRING_PTR(rb_pinned_text),
+			(size_t)RSTRING_LEN(rb_pinned_text),
+			(const uint8_t *)RSTRING_PTR(result),
+			result == rb_text ? 0 : (size_t)RSTRING_LEN(result), count);
+
+	RB_GC_GUARD(output.rb_str);
+	RB_GC_GUARD(rb_pinned_text);
+	return result;
+}
+
+/* Links as an array of `[start, end, kind]` triples */
+static VALUE
+links_to_ary(const struct rinku_link *links, size_t count)
+{
+	VALUE result = rb_ary_new2(count);
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		rb_ary_push(result, rb_ary_new3(3,
+			SIZET2NUM(links[i].start),
+			SIZET2NUM(links[i].end),
+			ID2SYM(id_link_kinds[links[i].kind])));
 	}
 
-	if (skip_tags != SKIP_TAGS)
-		xfree(skip_tags);
+	return result;
+}
+
+/* Whether `rb_link` is a frozen triple for `link`, so it can be shared */
+static bool
+link_is_frozen_triple(VALUE rb_link, const struct rinku_link *link)
+{
+	return RB_TYPE_P(rb_link, T_ARRAY) && OBJ_FROZEN(rb_link) &&
+		RARRAY_LEN(rb_link) == 3 &&
+		RARRAY_AREF(rb_link, 0) == SIZET2NUM(link->start) &&
+		RARRAY_AREF(rb_link, 1) == SIZET2NUM(link->end) &&
+		RARRAY_AREF(rb_link, 2) == ID2SYM(id_link_kinds[link->kind]);
+}
+
+/*
+ * links_to_ary for the links of an edited text, with frozen triples.
+ * The ones `rb_old_links` has for links that didn't move are reused:
+ * those before the edit, and those after it when its size didn't change.
+ */
+static VALUE
+links_to_ary_reusing(const struct rinku_link *links, size_t count,
+	VALUE rb_old_links)
+{
+	const long old_count = RARRAY_LEN(rb_old_links);
+	VALUE result = rb_ary_new2(count);
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		const long tail = old_count - (long)count + (long)i;
+		VALUE rb_link;
+
+		if ((long)i < old_count &&
+			link_is_frozen_triple(RARRAY_AREF(rb_old_links, i), &links[i]))
+			rb_link = RARRAY_AREF(rb_old_links, i);
+		else if (tail >= 0 && tail < old_count &&
+			link_is_frozen_triple(RARRAY_AREF(rb_old_links, tail), &links[i]))
+			rb_link = RARRAY_AREF(rb_old_links, tail);
+		else
+			rb_link = rb_ary_freeze(rb_ary_new3(3,
+				SIZET2NUM(links[i].start),
+				SIZET2NUM(links[i].end),
+				ID2SYM(id_link_kinds[links[i].kind])));
+
+		rb_ary_push(result, rb_link);
+	}
 
-	bufrelease(output_buf);
 	return result;
 }
 
-void RUBY_EXPORT Init_rinku()
+/* Raises what a failed extract set errno to, freeing its links */
+static void
+links_raise(struct rinku_links *links, int error)
 {
-	rb_mRinku = rb_define_module("Rinku");
-	rb_define_module_function(rb_mRinku, "auto_link", rb_rinku_autolink, -1);
-	rb_define_const(rb_mRinku, "AUTOLINK_SHORT_DOMAINS", INT2FIX(AUTOLINK_SHORT_DOMAINS));
+	rinku_links_free(links);
+
+	if (error == EINVAL)
+		rb_raise(rb_eArgError, "the links and the edit don't match the text");
+	if (error == EOVERFLOW)
+		rb_raise(rb_eRangeError, "too many links");
+	rb_memerror();
+}
+
+static VALUE
+links_ary_body(VALUE data)
+{
+	const struct rinku_links *links = (const struct rinku_links *)data;
+	return links_to_ary(links->data, links->count);
+}
+
+static VALUE
+links_str_body(VALUE data)
+{
+	const struct rinku_links *links = (const struct rinku_links *)data;
+	return rb_str_new((const char *)links->data,
+		(long)(links->count * sizeof(*links->data)));
 }
 
+static VALUE
+links_free_ensure(VALUE data)
+{
+	rinku_links_free((struct rinku_links *)data);
+	return Qnil;
+}
+
+/* Makes `links` into a Ruby object with `body` and frees them, even if
+ * that raises */
+static VALUE
+links_take(struct rinku_links *links, VALUE (*body)(VALUE))
+{
+	return rb_ensure(body, (VALUE)links, links_free_ensure, (VALUE)links);
+}
+
+/* The inverse of links_to_ary, kept in the bytes of a String so it's
+ * freed even if a bad link raises halfway through */
+static VALUE
+links_from_ary(VALUE rb_links)
+{
+	struct rinku_link *links;
+	VALUE rb_buf;
+	long i, count;
+
+	Check_Type(rb_links, T_ARRAY);
+	count = RARRAY_LEN(rb_links);
+
+	rb_buf = rb_str_buf_new(count * sizeof(*links));
+	rb_str_set_len(rb_buf, count * sizeof(*links));
+	links = (struct rinku_link *)RSTRING_PTR(rb_buf);
+	memset(links, 0, count * sizeof(*links));
+
+	for (i = 0; i < count; ++i) {
+		VALUE rb_link = rb_ary_entry(rb_links, i), rb_kind;
+		int kind;
+
+		if (!RB_TYPE_P(rb_link, T_ARRAY) || RARRAY_LEN(rb_link) != 3)
+			rb_raise(rb_eTypeError, "links must be [start, end, kind] triples");
+
+		rb_kind = rb_ary_entry(rb_link, 2);
+		for (kind = RINKU_LINK_WWW; kind <= RINKU_LINK_URL; ++kind) {
+			if (rb_kind == ID2SYM(id_link_kinds[kind]))
+				links[i].kind = (rinku_link_kind)kind;
+		}
+
+		if (links[i].kind == 0)
+			rb_raise(rb_eTypeError, "links must be [start, end, kind] triples");
+
+		links[i].start = NUM2SIZET(rb_ary_entry(rb_link, 0));
+		links[i].end = NUM2SIZET(rb_ary_entry(rb_link, 1));
+	}
+
+	return rb_buf;
+}
+
+/*
+ * Finds the links in `rb_text` with a ready config, as an array of
+ * `[start, end, kind]` triples. Like `autolink_run`, large inputs are
+ * scanned with the GVL released.
+ */
+static VALUE
+extract_run(VALUE rb_text, const struct rinku_config *cfg)
+{
+	VALUE result, rb_pinned_text = rb_text;
+	struct extract_args args;
+
+	if (autolink_use_nogvl(rb_text, Qnil))
+		rb_pinned_text = rb_str_new_frozen(rb_text);
+
+	memset(&args, 0, sizeof(args));
+	args.text = (const uint8_t *)RSTRING_PTR(rb_pinned_text);
+	args.size = (size_t)RSTRING_LEN(rb_pinned_text);
+	args.cfg = cfg;
+
+	if (rb_pinned_text != rb_text)
+		rb_thread_call_without_gvl(extract_nogvl, &args, NULL, NULL);
+	else
+		extract_nogvl(&args);
+
+	if (args.count < 0)
+		links_raise(&args.links, args.error);
+
+	result = links_take(&args.links, links_ary_body);
+
+	RB_GC_GUARD(rb_pinned_text);
+	return result;
+}
+
+/* What autolink_batch keeps between its body and its cleanup */
+struct batch_run {
+	VALUE rb_texts, rb_pinned, rb_block, results;
+	bool frozen_links;
+	size_t total;
+	struct batch_args args;
+};
+
+static VALUE
+autolink_batch_body(VALUE data)
+{
+	struct batch_run *run = (struct batch_run *)data;
+	struct batch_args *args = &run->args;
+	struct buf *output_buf = args->ob;
+	long i, done;
+
+	if (RTEST(run->rb_block) || run->total < RINKU_NOGVL_THRESHOLD) {
+		struct callback_data cbdata;
+
+		cbdata.rb_block = run->rb_block;
+		cbdata.frozen_links = run->frozen_links;
+
+		for (i = 0; i < args->count; ++i) {
+			VALUE rb_text = rb_ary_entry(run->rb_pinned, i);
+
+			cbdata.rb_text = rb_text;
+			cbdata.encoding = rb_enc_get(rb_text);
+			output_buf->size = 0;
+
+			rinku_autolink_with(output_buf,
+				(const uint8_t *)RSTRING_PTR(rb_text),
+				(size_t)RSTRING_LEN(rb_text),
+				args->cfg,
+				RTEST(run->rb_block) ? &autolink_callback : NULL,
+				(void*)&cbdata);
+
+			rb_ary_push(run->results, output_buf->size == 0 ?
+				rb_ary_entry(run->rb_texts, i) :
+				rb_enc_str_new((char *)output_buf->data,
+					output_buf->size, cbdata.encoding));
+		}
+	} else {
+		args->next = 0;
+		args->items = ALLOC_N(struct batch_item, args->count ? args->count : 1);
+
+		for (i = 0; i < args->count; ++i) {
+			VALUE rb_text = rb_ary_entry(run->rb_pinned, i);
+			args->items[i].text = (const uint8_t *)RSTRING_PTR(rb_text);
+			args->items[i].size = (size_t)RSTRING_LEN(rb_text);
+		}
+
+		for (done = 0; done < args->count; done = args->next) {
+			output_buf->size = 0;
+			rb_thread_call_without_gvl(autolink_batch_nogvl, args, NULL, NULL);
+
+			for (i = done; i < args->next; ++i) {
+				const struct batch_item *item = &args->items[i];
+				VALUE rb_text = rb_ary_entry(run->rb_texts, i);
+
+				rb_ary_push(run->results, item->out_size == 0 ? rb_text :
+					rb_enc_str_new((char *)output_buf->data + item->out_start,
+						item->out_size, rb_enc_get(rb_text)));
+			}
+		}
+	}
+
+	return run->results;
+}
+
+/* Gives back the scratch buffer, even when a block raised or broke out */
+static VALUE
+autolink_batch_cleanup(VALUE data)
+{
+	struct batch_run *run = (struct batch_run *)data;
+
+	xfree(run->args.items);
+	bufpool_put(run->args.ob);
+	return Qnil;
+}
+
+/*
+ * Autolinks every string in `rb_texts` with the same config and a single
+ * scratch buffer. Without a block, batches that add up to a large input
+ * are scanned with the GVL released, flushing results back to Ruby
+ * every RINKU_BATCH_FLUSH_SIZE bytes of output.
+ */
+static VALUE
+autolink_batch(VALUE rb_texts, const struct rinku_config *cfg,
+	VALUE rb_block, bool frozen_links)
+{
+	struct batch_run run;
+	long i;
+
+	Check_Type(rb_texts, T_ARRAY);
+
+	run.rb_texts = rb_texts;
+	run.rb_pinned = rb_texts;
+	run.rb_block = rb_block;
+	run.frozen_links = frozen_links;
+	run.total = 0;
+	run.args.count = RARRAY_LEN(rb_texts);
+	run.args.cfg = cfg;
+	run.args.items = NULL;
+
+	for (i = 0; i < run.args.count; ++i) {
+		VALUE rb_text = rb_ary_entry(rb_texts, i);
+		validate_encoding(rb_text);
+		run.total += RSTRING_LEN(rb_text);
+	}
+
+	/*
+	 * The texts are pinned when a block could modify them halfway through
+	 * the batch, or when they are going to be read without the GVL
+	 */
+	if (RTEST(rb_block) || run.total >= RINKU_NOGVL_THRESHOLD) {
+		run.rb_pinned = rb_ary_new2(run.args.count);
+		for (i = 0; i < run.args.count; ++i)
+			rb_ary_push(run.rb_pinned, rb_str_new_frozen(rb_ary_entry(rb_texts, i)));
+	}
+
+	run.results = rb_ary_new2(run.args.count);
+
+	/* nothing that can raise runs between taking the buffer and rb_ensure */
+	run.args.ob = bufpool_get(32);
+	if (run.args.ob == NULL)
+		rb_memerror();
+
+	rb_ensure(autolink_batch_body, (VALUE)&run, autolink_batch_cleanup, (VALUE)&run);
+
+	RB_GC_GUARD(run.rb_pinned);
+	RB_GC_GUARD(run.rb_texts);
+	return run.results;
+}
+
+/*
+ * Returns a frozen copy of a skip tags array, made of frozen strings, so
+ * other threads can't change them while the GVL is released
+ */
+static VALUE
+rinku_pin_tags(VALUE rb_skip)
+{
+	VALUE pinned;
+	long i;
+
+	Check_Type(rb_skip, T_ARRAY);
+	pinned = rb_ary_new2(RARRAY_LEN(rb_skip));
+
+	for (i = 0; i < RARRAY_LEN(rb_skip); ++i) {
+		VALUE tag = rb_ary_entry(rb_skip, i);
+		Check_Type(tag, T_STRING);
+		rb_ary_push(pinned, rb_str_new_frozen(tag));
+	}
+
+	return rb_obj_freeze(pinned);
+}
+
+const char **rinku_load_tags(VALUE rb_skip)
+{
+	const char **skip_tags;
+	size_t i, count;
+
+	Check_Type(rb_skip, T_ARRAY);
+
+	count = RARRAY_LEN(rb_skip);
+	skip_tags = xmalloc(sizeof(void *) * (count + 1));
+
+	for (i = 0; i < count; ++i) {
+		VALUE tag = rb_ary_entry(rb_skip, i);
+		Check_Type(tag, T_STRING);
+		skip_tags[i] = StringValueCStr(tag);
+	}
+
+	skip_tags[count] = NULL;
+	return skip_tags;
+}
+
+/*
+ * Document-method: auto_link
+ *
+ * call-seq:
+ *  auto_link(text, mode=:all, link_attr=nil, skip_tags=nil, flags=0)
+ *  auto_link(text, mode=:all, link_attr=nil, skip_tags=nil, flags=0) { |link_text| ... }
+ *
+ * Parses a block of text looking for "safe" urls or email addresses,
+ * and turns them into HTML links with the given attributes.
+ *
+ * NOTE: The block of text may or may not be HTML; if the text is HTML,
+ * Rinku will skip the relevant tags to prevent double-linking and linking
+ * inside `pre` blocks by default.
+ *
+ * NOTE: If the input text is HTML, it's expected to be already escaped.
+ * Rinku will perform no escaping.
+ *
+ * NOTE: When no block is given, large texts are autolinked with the GVL
+ * released, so other Ruby threads keep running in the meantime.
+ *
+ * NOTE: Currently the follow protocols are considered safe and are the
+ * only ones that will be autolinked.
+ *
+ *     http:// https:// ftp:// mailto://
+ *
+ * Email addresses are also autolinked by default. URLs without a protocol
+ * specifier but starting with 'www.' will also be autolinked, defaulting to
+ * the 'http://' protocol.
+ *
+ * -   `text` is a string in plain text or HTML markup. If the string is formatted in
+ * HTML, Rinku is smart enough to skip the links that are already enclosed in `<a>`
+ * tags.`
+ *
+ * -   `mode` is a symbol, either `:all`, `:urls` or `:email_addresses`, 
+ * which specifies which kind of links will be auto-linked. 
+ *
+ * -   `link_attr` is a string containing the link attributes for each link that
+ * will be generated. These attributes are not sanitized and will be include as-is
+ * in each generated link, e.g.
+ *
+ *      ~~~~~ruby
+ *      auto_link('http://www.pokemon.com', :all, 'target="_blank"')
+ *      # => '<a href="http://www.pokemon.com" target="_blank">http://www.pokemon.com</a>'
+ *      ~~~~~
+ *
+ *     This string can be autogenerated from a hash using the Rails `tag_options` helper.
+ *
+ * -   `skip_tags` is a list of strings with the names of HTML tags that will be skipped
+ * when autolinking. If `nil`, this defaults to the value of the global `Rinku.skip_tags`,
+ * which is initially `["a", "pre", "code", "kbd", "script"]`.
+ * Tag names are matched case-insensitively.
+ *
+ * -   `flag` is an optional boolean value specifying whether to recognize
+ * 'http://foo' as a valid domain, or require at least one '.'. It defaults to false.
+ *
+ * -   `&block` is an optional block argument. If a block is passed, it will
+ * be yielded for each found link in the text, and its return value will be used instead
+ * of the name of the link. E.g.
+ *
+ *     ~~~~~ruby
+ *     auto_link('Check it out at http://www.pokemon.com') do |url|
+ *       "THE POKEMAN WEBSITEZ"
+ *     end
+ *     # => 'Check it out at <a href="http://www.pokemon.com">THE POKEMAN WEBSITEZ</a>'
+ *     ~~~~~~
+ */
+/*
+ * Returns the config for the positional `auto_link` options: the default
+ * one, or one built in `cfg`. When `pin` is set, the strings it references
+ * are swapped for frozen copies first. The skip tags list must be freed
+ * with `free_module_config`.
+ */
+static const struct rinku_config *
+module_config(struct rinku_config *cfg, VALUE self, VALUE rb_mode,
+	VALUE *rb_html, VALUE *rb_skip, VALUE rb_flags, bool pin)
+{
+	const char *link_attr = NULL;
+	const char **skip_tags;
+	unsigned int link_flags;
+	int link_mode;
+
+	link_mode = parse_mode(rb_mode);
+	link_flags = parse_flags(rb_flags);
+
+	if (NIL_P(*rb_skip))
+		*rb_skip = rb_iv_get(self, "@skip_tags");
+
+	if (link_mode == AUTOLINK_ALL && link_flags == 0 &&
+		NIL_P(*rb_html) && NIL_P(*rb_skip))
+		return &g_default_config;
+
+	if (!NIL_P(*rb_html)) {
+		Check_Type(*rb_html, T_STRING);
+		if (pin)
+			*rb_html = rb_str_new_frozen(*rb_html);
+		link_attr = RSTRING_PTR(*rb_html);
+	}
+
+	if (NIL_P(*rb_skip)) {
+		skip_tags = SKIP_TAGS;
+	} else {
+		if (pin)
+			*rb_skip = rinku_pin_tags(*rb_skip);
+		skip_tags = rinku_load_tags(*rb_skip);
+	}
+
+	rinku_config_init(cfg, link_mode, link_flags, link_attr, skip_tags);
+	return cfg;
+}
+
+static void
+free_module_config(const struct rinku_config *cfg)
+{
+	if (cfg->skip_tags != SKIP_TAGS)
+		xfree(cfg->skip_tags);
+}
+
+static VALUE
+rb_rinku_autolink(int argc, VALUE *argv, VALUE self)
+{
+	VALUE result, rb_text, rb_mode, rb_html, rb_skip, rb_flags, rb_block;
+	rb_encoding *text_encoding;
+	struct rinku_config storage;
+	const struct rinku_config *cfg;
+	bool truncated;
+
+	rb_scan_args(argc, argv, "14&", &rb_text, &rb_mode,
+		&rb_html, &rb_skip, &rb_flags, &rb_block); 
+
+	text_encoding = validate_encoding(rb_text);
+
+	/*
+	 * Large inputs are scanned without the GVL. Everything the scan reads
+	 * is pinned first, as frozen copies that share the original bytes.
+	 */
+	cfg = module_config(&storage, self, rb_mode, &rb_html, &rb_skip,
+		rb_flags, autolink_use_nogvl(rb_text, rb_block));
+
+	result = autolink_run(rb_text, text_encoding, cfg, rb_block, false, 1,
+		&truncated);
+	free_module_config(cfg);
+
+	RB_GC_GUARD(rb_html);
+	RB_GC_GUARD(rb_skip);
+	return result;
+}
+
+/*
+ * Document-method: auto_link_many
+ *
+ * call-seq:
+ *  auto_link_many(texts, mode=:all, link_attr=nil, skip_tags=nil, flags=0)
+ *  auto_link_many(texts, mode=:all, link_attr=nil, skip_tags=nil, flags=0) { |link_text| ... }
+ *
+ * Autolinks every string in the `texts` array with the same options,
+ * which are parsed only once, and returns an array with the results in
+ * the same order. See `auto_link` for the meaning of each option.
+ */
+static VALUE
+rb_rinku_autolink_many(int argc, VALUE *argv, VALUE self)
+{
+	VALUE result, rb_texts, rb_mode, rb_html, rb_skip, rb_flags, rb_block;
+	struct rinku_config storage;
+	const struct rinku_config *cfg;
+
+	rb_scan_args(argc, argv, "14&", &rb_texts, &rb_mode,
+		&rb_html, &rb_skip, &rb_flags, &rb_block); 
+
+	Check_Type(rb_texts, T_ARRAY);
+	cfg = module_config(&storage, self, rb_mode, &rb_html, &rb_skip,
+		rb_flags, !RTEST(rb_block));
+
+	result = autolink_batch(rb_texts, cfg, rb_block, false);
+	free_module_config(cfg);
+
+	RB_GC_GUARD(rb_html);
+	RB_GC_GUARD(rb_skip);
+	return result;
+}
+
+/*
+ * Document-method: extract_links
+ *
+ * call-seq:
+ *  extract_links(text, mode=:all, skip_tags=nil, flags=0)
+ *
+ * Returns the links that `auto_link` would make in `text`, without
+ * building any HTML, as an array of `[start, end, kind]` triples. `start`
+ * and `end` are byte offsets into `text` (use `byteslice` to get the
+ * link), and `kind` is one of `:url`, `:www` or `:email`. See `auto_link`
+ * for the meaning of each option.
+ */
+static VALUE
+rb_rinku_extract_links(int argc, VALUE *argv, VALUE self)
+{
+	VALUE result, rb_text, rb_mode, rb_html = Qnil, rb_skip, rb_flags;
+	struct rinku_config storage;
+	const struct rinku_config *cfg;
+
+	rb_scan_args(argc, argv, "13", &rb_text, &rb_mode, &rb_skip, &rb_flags);
+
+	validate_encoding(rb_text);
+	cfg = module_config(&storage, self, rb_mode, &rb_html, &rb_skip,
+		rb_flags, autolink_use_nogvl(rb_text, Qnil));
+
+	result = extract_run(rb_text, cfg);
+	free_module_config(cfg);
+
+	RB_GC_GUARD(rb_skip);
+	return result;
+}
+
+/*
+ * Document-method: stats
+ *
+ * call-seq:
+ *  stats -> hash or nil
+ *
+ * Returns the hot-path counters of the current thread, added up over
+ * everything it autolinked since the last `reset_stats`, or nil when
+ * Rinku was built without `--enable-stats`.
+ */
+static VALUE
+rb_rinku_stats(VALUE self)
+{
+#ifdef RINKU_STATS
+	const struct rinku_stats *st = &rinku_thread_stats;
+	VALUE rb_stats = rb_hash_new();
+	int kind;
+
+#define SET_STAT(name, value) \
+	rb_hash_aset(rb_stats, ID2SYM(rb_intern(name)), SIZET2NUM(value))
+
+	SET_STAT("bytes_scanned", st->bytes_scanned);
+	SET_STAT("tag_triggers", st->tag_triggers);
+	SET_STAT("skipped_tag_bytes", st->skipped_tag_bytes);
+
+	for (kind = RINKU_LINK_WWW; kind <= RINKU_LINK_URL; ++kind) {
+		const char *name = rb_id2name(id_link_kinds[kind]);
+
+		rb_hash_aset(rb_stats, ID2SYM(rb_intern_str(
+			rb_sprintf("%s_attempts", name))), SIZET2NUM(st->attempts[kind]));
+		rb_hash_aset(rb_stats, ID2SYM(rb_intern_str(
+			rb_sprintf("%s_matches", name))), SIZET2NUM(st->matches[kind]));
+	}
+
+	SET_STAT("buffer_reallocs", st->buf_reallocs);
+	SET_STAT("callback_ns", st->callback_ns);
+
+#undef SET_STAT
+
+	return rb_stats;
+#else
+	return Qnil;
+#endif
+}
+
+/*
+ * Document-method: cache_size=
+ *
+ * call-seq:
+ *  cache_size = bytes
+ *
+ * Turns on the result cache with room for `bytes` of input and output:
+ * calls without a block whose text and options match a recent call
+ * return its result without linking the text again. With 0 (the
+ * default) the cache is emptied and turned off.
+ */
+static VALUE
+rb_rinku_set_cache_size(VALUE self, VALUE rb_size)
+{
+	LONG_LONG size = NUM2LL(rb_size);
+
+	if (size < 0)
+		rb_raise(rb_eArgError, "cache size can't be negative");
+
+	if (rinku_cache_set_capacity((size_t)size) < 0)
+		rb_raise(rb_eNotImpError, "Rinku was built without a result cache");
+
+	return rb_size;
+}
+
+/*
+ * Document-method: cache_size
+ *
+ * call-seq:
+ *  cache_size -> integer
+ *
+ * The capacity of the result cache in bytes; 0 when it's off.
+ */
+static VALUE
+rb_rinku_cache_size(VALUE self)
+{
+	return SIZET2NUM(rinku_cache_capacity());
+}
+
+/*
+ * Document-method: cache_stats
+ *
+ * call-seq:
+ *  cache_stats -> hash
+ *
+ * Counters for sizing the result cache, shared by all threads: `hits`,
+ * `misses` and `evictions` since the process started, and the `entries`
+ * and `bytes` it holds now out of its `capacity`.
+ */
+static VALUE
+rb_rinku_cache_stats(VALUE self)
+{
+	struct rinku_cache_stats st;
+	VALUE rb_stats = rb_hash_new();
+
+	rinku_cache_get_stats(&st);
+
+#define SET_STAT(name, value) \
+	rb_hash_aset(rb_stats, ID2SYM(rb_intern(name)), SIZET2NUM(value))
+
+	SET_STAT("hits", st.hits);
+	SET_STAT("misses", st.misses);
+	SET_STAT("evictions", st.evictions);
+	SET_STAT("entries", st.entries);
+	SET_STAT("bytes", st.bytes);
+	SET_STAT("capacity", st.capacity);
+
+#undef SET_STAT
+
+	return rb_stats;
+}
+
+/*
+ * Document-method: reset_stats
+ *
+ * call-seq:
+ *  reset_stats -> nil
+ *
+ * Zeroes the counters returned by `stats` for the current thread.
+ */
+static VALUE
+rb_rinku_reset_stats(VALUE self)
+{
+#ifdef RINKU_STATS
+	memset(&rinku_thread_stats, 0, sizeof(rinku_thread_stats));
+#endif
+	return Qnil;
+}
+
+static void
+free_string_list(char **list)
+{
+	char **str;
+
+	if (list == NULL)
+		return;
+
+	for (str = list; *str != NULL; ++str)
+		xfree(*str);
+	xfree(list);
+}
+
+static size_t
+string_list_memsize(char **list)
+{
+	size_t size = 0;
+	char **str;
+
+	if (list == NULL)
+		return 0;
+
+	for (str = list; *str != NULL; ++str)
+		size += sizeof(char *) + strlen(*str) + 1;
+
+	return size + sizeof(char *);
+}
+
+static void
+rinku_linker_free(void *ptr)
+{
+	struct rinku_linker *linker = ptr;
+
+	xfree(linker->link_attr);
+	free_string_list(linker->skip_tags);
+	free_string_list(linker->schemes);
+	xfree(linker);
+}
+
+static size_t
+rinku_linker_memsize(const void *ptr)
+{
+	const struct rinku_linker *linker = ptr;
+	size_t size = sizeof(*linker);
+
+	if (linker->link_attr)
+		size += strlen(linker->link_attr) + 1;
+
+	size += string_list_memsize(linker->skip_tags);
+	size += string_list_memsize(linker->schemes);
+	return size;
+}
+
+/* A linker is never modified once it's initialized (and frozen), so
+ * frozen linkers can be shared between Ractors */
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#define RINKU_LINKER_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE)
+#else
+#define RINKU_LINKER_FLAGS RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+
+static const rb_data_type_t rinku_linker_type = {
+	"Rinku::Linker",
+	{ NULL, rinku_linker_free, rinku_linker_memsize, },
+	NULL, NULL, RINKU_LINKER_FLAGS
+};
+
+static void
+rinku_stream_mark(void *ptr)
+{
+	struct rinku_linker_stream *stream = ptr;
+	rb_gc_mark(stream->rb_linker);
+}
+
+static void
+rinku_stream_type_free(void *ptr)
+{
+	struct rinku_linker_stream *stream = ptr;
+	rinku_stream_free(stream->stream);
+	xfree(stream);
+}
+
+static const rb_data_type_t rinku_stream_type = {
+	"Rinku::Stream",
+	{ rinku_stream_mark, rinku_stream_type_free, NULL, },
+	NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rb_linker_alloc(VALUE klass)
+{
+	struct rinku_linker *linker;
+	return TypedData_Make_Struct(klass, struct rinku_linker,
+		&rinku_linker_type, linker);
+}
+
+static struct rinku_linker *
+get_linker(VALUE self)
+{
+	struct rinku_linker *linker;
+	TypedData_Get_Struct(self, struct rinku_linker, &rinku_linker_type, linker);
+
+	if (!linker->ready)
+		rb_raise(rb_eRuntimeError, "uninitialized Rinku::Linker");
+
+	return linker;
+}
+
+/*
+ * Copies an Array of Strings into a NULL-terminated list owned by the
+ * linker, storing it in `*list` before it's filled in: it's zeroed, so a
+ * raise halfway through leaves a list we can free.
+ */
+static void
+copy_string_list(char ***list, VALUE rb_list)
+{
+	long i, count;
+
+	Check_Type(rb_list, T_ARRAY);
+	count = RARRAY_LEN(rb_list);
+
+	*list = ALLOC_N(char *, count + 1);
+	MEMZERO(*list, char *, count + 1);
+
+	for (i = 0; i < count; ++i) {
+		VALUE str = rb_ary_entry(rb_list, i);
+		Check_Type(str, T_STRING);
+		(*list)[i] = ruby_strdup(StringValueCStr(str));
+	}
+}
+
+/* URL schemes are found by walking back over letters from the ':', so
+ * a scheme with anything else in its name could never be linked */
+static void
+check_schemes(char **schemes)
+{
+	char **scheme;
+	const char *c;
+
+	for (scheme = schemes; *scheme != NULL; ++scheme) {
+		if ((scheme - schemes) >= AUTOLINK_MAX_SCHEMES)
+			rb_raise(rb_eArgError, "too many schemes (at most %d)",
+				AUTOLINK_MAX_SCHEMES);
+
+		if (**scheme == '\0' || strlen(*scheme) > AUTOLINK_MAX_SCHEME_SIZE)
+			rb_raise(rb_eArgError, "invalid scheme '%s'", *scheme);
+
+		for (c = *scheme; *c; ++c) {
+			if (!rinku_isalpha(*c))
+				rb_raise(rb_eArgError,
+					"invalid scheme '%s' (only letters are allowed)", *scheme);
+		}
+	}
+}
+
+/* A `max_links` or `max_work` option: nil for no limit, or at least 1 */
+static size_t
+parse_budget(VALUE rb_limit, const char *name)
+{
+	LONG_LONG limit;
+
+	if (NIL_P(rb_limit))
+		return 0;
+
+	limit = NUM2LL(rb_limit);
+	if (limit < 1)
+		rb_raise(rb_eArgError, "%s must be positive", name);
+
+	return (size_t)limit;
+}
+
+/* :nodoc: called by Rinku::Linker#initialize */
+static VALUE
+rb_linker_compile(VALUE self, VALUE rb_mode, VALUE rb_html,
+	VALUE rb_skip, VALUE rb_schemes, VALUE rb_flags, VALUE rb_frozen_links,
+	VALUE rb_threads, VALUE rb_max_links, VALUE rb_max_work)
+{
+	struct rinku_linker *linker;
+	const char **skip_tags = SKIP_TAGS;
+	unsigned int link_flags;
+	int link_mode, threads;
+	size_t max_links, max_work;
+
+	TypedData_Get_Struct(self, struct rinku_linker, &rinku_linker_type, linker);
+
+	if (linker->ready || linker->link_attr || linker->skip_tags || linker->schemes)
+		rb_raise(rb_eRuntimeError, "Rinku::Linker is already initialized");
+
+	link_mode = parse_mode(rb_mode);
+	link_flags = parse_flags(rb_flags);
+	threads = NUM2INT(rb_threads);
+
+	if (threads < 1 || threads > RINKU_PARALLEL_MAX_THREADS)
+		rb_raise(rb_eArgError, "threads must be between 1 and %d",
+			RINKU_PARALLEL_MAX_THREADS);
+
+	max_links = parse_budget(rb_max_links, "max_links");
+	max_work = parse_budget(rb_max_work, "max_work");
+
+	/* a budget is spent in order, so it can't be split over threads */
+	if (threads > 1 && (max_links || max_work))
+		rb_raise(rb_eArgError, "threads can't be combined with max_links or max_work");
+
+	if (!NIL_P(rb_html)) {
+		Check_Type(rb_html, T_STRING);
+		linker->link_attr = ruby_strdup(StringValueCStr(rb_html));
+	}
+
+	if (!NIL_P(rb_skip)) {
+		copy_string_list(&linker->skip_tags, rb_skip);
+		skip_tags = (const char **)linker->skip_tags;
+	}
+
+	if (!NIL_P(rb_schemes)) {
+		copy_string_list(&linker->schemes, rb_schemes);
+		check_schemes(linker->schemes);
+	}
+
+	rinku_config_init(&linker->config, link_mode, link_flags,
+		linker->link_attr, skip_tags);
+
+	if (linker->schemes)
+		rinku_config_set_schemes(&linker->config, (const char **)linker->schemes);
+
+	rinku_config_set_budget(&linker->config, max_links, max_work);
+
+	linker->frozen_links = RTEST(rb_frozen_links);
+	linker->threads = threads;
+	linker->ready = true;
+
+	return self;
+}
+
+/*
+ * Document-method: Rinku::Linker#auto_link
+ *
+ * call-seq:
+ *  auto_link(text)
+ *  auto_link(text) { |link_text| ... }
+ *
+ * Same as `Rinku.auto_link`, using the options this linker was created
+ * with. Those were parsed once, when the linker was created.
+ */
+static VALUE
+rb_linker_autolink(int argc, VALUE *argv, VALUE self)
+{
+	struct rinku_linker *linker = get_linker(self);
+	VALUE rb_text, rb_block, result;
+	rb_encoding *text_encoding;
+	bool truncated;
+
+	rb_scan_args(argc, argv, "1&", &rb_text, &rb_block);
+	text_encoding = validate_encoding(rb_text);
+
+	result = autolink_run(rb_text, text_encoding, &linker->config,
+		rb_block, linker->frozen_links, linker->threads, &truncated);
+
+	RB_GC_GUARD(self);
+	return result;
+}
+
+/*
+ * Document-method: Rinku::Linker#auto_link_limited
+ *
+ * call-seq:
+ *  auto_link_limited(text) -> [html, truncated]
+ *  auto_link_limited(text) { |link_text| ... } -> [html, truncated]
+ *
+ * Same as `auto_link`, also returning whether the `max_links` or
+ * `max_work` budget of this linker ran out before the end of the text,
+ * in which case the rest of it was left as it was.
+ */
+static VALUE
+rb_linker_autolink_limited(int argc, VALUE *argv, VALUE self)
+{
+	struct rinku_linker *linker = get_linker(self);
+	VALUE rb_text, rb_block, result;
+	rb_encoding *text_encoding;
+	bool truncated;
+
+	rb_scan_args(argc, argv, "1&", &rb_text, &rb_block);
+	text_encoding = validate_encoding(rb_text);
+
+	result = autolink_run(rb_text, text_encoding, &linker->config,
+		rb_block, linker->frozen_links, linker->threads, &truncated);
+
+	RB_GC_GUARD(self);
+	return rb_assoc_new(result, truncated ? Qtrue : Qfalse);
+}
+
+/*
+ * Document-method: Rinku::Linker#auto_link_many
+ *
+ * call-seq:
+ *  auto_link_many(texts)
+ *  auto_link_many(texts) { |link_text| ... }
+ *
+ * Same as `Rinku.auto_link_many`, using the options this linker was
+ * created with.
+ */
+static VALUE
+rb_linker_autolink_many(int argc, VALUE *argv, VALUE self)
+{
+	struct rinku_linker *linker = get_linker(self);
+	VALUE rb_texts, rb_block, result;
+
+	rb_scan_args(argc, argv, "1&", &rb_texts, &rb_block);
+	result = autolink_batch(rb_texts, &linker->config,
+		rb_block, linker->frozen_links);
+
+	RB_GC_GUARD(self);
+	return result;
+}
+
+/*
+ * Document-method: Rinku::Linker#extract_links
+ *
+ * call-seq:
+ *  extract_links(text)
+ *
+ * Same as `Rinku.extract_links`, using the options this linker was
+ * created with.
+ */
+static VALUE
+rb_linker_extract_links(VALUE self, VALUE rb_text)
+{
+	struct rinku_linker *linker = get_linker(self);
+	VALUE result;
+
+	validate_encoding(rb_text);
+	result = extract_run(rb_text, &linker->config);
+
+	RB_GC_GUARD(self);
+	return result;
+}
+
+/*
+ * Document-method: Rinku::Linker#relink
+ *
+ * call-seq:
+ *  relink(text, links, edit_start, edit_old_end, edit_new_end) -> [html, links]
+ *  relink(text, links, edit_start, edit_old_end, edit_new_end) { |link_text| ... } -> [html, links]
+ *
+ * Autolinks a text that was just edited, given the `links` that
+ * `extract_links` (or an earlier `relink`) returned for it before the
+ * edit. The edit replaced the bytes from `edit_start` up to
+ * `edit_old_end` of the old text with the bytes from `edit_start` up to
+ * `edit_new_end` of `text`. Only the text around the edit is scanned
+ * again; the html is built straight from the links, which are returned
+ * for the next edit as frozen triples, the same objects as before where
+ * a link didn't move. Building the html still copies the whole text.
+ *
+ *     links = linker.extract_links(text)
+ *     text[10, 0] = "www.pokemon.com "
+ *     html, links = linker.relink(text, links, 10, 10, 26)
+ */
+static VALUE
+rb_linker_relink(int argc, VALUE *argv, VALUE self)
+{
+	struct rinku_linker *linker = get_linker(self);
+	VALUE rb_text, rb_links, rb_start, rb_old_end, rb_new_end, rb_block;
+	VALUE rb_old, rb_new, rb_new_ary, rb_pinned_text, result;
+	struct callback_data cbdata;
+	struct rstring_output output;
+	rb_encoding *text_encoding;
+	const uint8_t *text;
+	struct rinku_links found = { NULL, 0, 0 };
+	size_t size, edit_start, edit_old_end, edit_new_end;
+	int coderange, count;
+
+	rb_scan_args(argc, argv, "5&", &rb_text, &rb_links,
+		&rb_start, &rb_old_end, &rb_new_end, &rb_block);
+
+	text_encoding = validate_encoding(rb_text);
+	rb_old = links_from_ary(rb_links);
+	edit_start = NUM2SIZET(rb_start);
+	edit_old_end = NUM2SIZET(rb_old_end);
+	edit_new_end = NUM2SIZET(rb_new_end);
+
+	/* pinned so the block can't modify the text while it's rendered */
+	rb_pinned_text = rb_str_new_frozen(rb_text);
+	text = (const uint8_t *)RSTRING_PTR(rb_pinned_text);
+	size = (size_t)RSTRING_LEN(rb_pinned_text);
+
+	/* the scan is only resumed halfway through text it can decode */
+	coderange = ENC_CODERANGE(rb_text);
+	if (coderange == ENC_CODERANGE_7BIT ||
+		(coderange == ENC_CODERANGE_VALID && rb_enc_to_index(text_encoding) == rb_utf8_encindex()))
+		count = rinku_extract_links_edit(&found, text, size, &linker->config,
+			(const struct rinku_link *)RSTRING_PTR(rb_old),
+			RSTRING_LEN(rb_old) / sizeof(struct rinku_link),
+			edit_start, edit_old_end, edit_new_end);
+	else
+		count = rinku_extract_links(&found, text, size, &linker->config);
+
+	if (count < 0)
+		links_raise(&found, errno);
+
+	/* into a String before the block runs, in case it raises, and
+	 * into triples while `rb_links` is still what it was */
+	rb_new = links_take(&found, links_str_body);
+	rb_new_ary = links_to_ary_reusing((const struct rinku_link *)RSTRING_PTR(rb_new),
+		RSTRING_LEN(rb_new) / sizeof(struct rinku_link), rb_links);
+
+	cbdata.rb_block = rb_block;
+	cbdata.rb_text = rb_pinned_text;
+	cbdata.encoding = text_encoding;
+	cbdata.frozen_links = linker->frozen_links;
+
+	rstring_output_init(&output, text_encoding, false);
+	count = rinku_render_links(&output.ob, text, size, &linker->config,
+		(const struct rinku_link *)RSTRING_PTR(rb_new),
+		RSTRING_LEN(rb_new) / sizeof(struct rinku_link),
+		RTEST(rb_block) ? &autolink_callback : NULL, (void *)&cbdata);
+
+	result = NIL_P(output.rb_str) && !output.error ?
+		rb_text : rstring_output_finish(&output);
+
+	RB_GC_GUARD(rb_old);
+	RB_GC_GUARD(rb_new);
+	RB_GC_GUARD(rb_pinned_text);
+	RB_GC_GUARD(self);
+	return rb_assoc_new(result, rb_new_ary);
+}
+
+#ifdef RINKU_HAVE_FILES
+/*
+ * Document-method: Rinku::Linker#auto_link_file
+ *
+ * call-seq:
+ *  auto_link_file(in_path, out_path)
+ *
+ * Autolinks the file at `in_path` into `out_path`, which is created or
+ * overwritten, using the options this linker was created with. The text
+ * is never read into a String: the input is mapped into memory and the
+ * output is written as it's made. Returns the number of links.
+ *
+ * Like auto_link, it raises ArgumentError if the input isn't valid UTF-8.
+ * A file at `out_path` is only replaced once the new one is complete, so
+ * it's left as it was when linking fails.
+ */
+static VALUE
+rb_linker_autolink_file(VALUE self, VALUE rb_in, VALUE rb_out)
+{
+	struct rinku_linker *linker = get_linker(self);
+	struct file_args args;
+	struct rinku_output out;
+	struct stat in_st, out_st;
+	int error;
+
+	FilePathValue(rb_in);
+	FilePathValue(rb_out);
+
+	args.in_fd = rb_cloexec_open(StringValueCStr(rb_in), O_RDONLY, 0);
+	if (args.in_fd < 0)
+		rb_sys_fail_str(rb_in);
+	rb_update_max_fd(args.in_fd);
+
+	if (fstat(args.in_fd, &in_st) < 0) {
+		error = errno;
+		close(args.in_fd);
+		rb_syserr_fail_str(error, rb_in);
+	}
+
+	if (stat(StringValueCStr(rb_out), &out_st) == 0 &&
+		in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+		close(args.in_fd);
+		rb_raise(rb_eArgError, "can't autolink a file into itself");
+	}
+
+	if (rinku_output_open(&out, StringValueCStr(rb_out)) < 0) {
+		error = errno;
+		close(args.in_fd);
+		rb_syserr_fail_str(error, rb_out);
+	}
+	rb_update_max_fd(out.fd);
+
+	args.out_fd = out.fd;
+	args.cfg = &linker->config;
+	rb_thread_call_without_gvl(autolink_file_nogvl, &args, NULL, NULL);
+
+	error = args.error;
+	close(args.in_fd);
+
+	/* the output only replaces what was there once it's complete */
+	if (rinku_output_close(&out, args.count >= 0) < 0 && args.count >= 0) {
+		args.count = -1;
+		error = errno;
+	}
+
+	if (args.count < 0) {
+		if (error == EILSEQ)
+			rb_raise(rb_eArgError, "invalid byte sequence in UTF-8");
+
+		rb_syserr_fail_str(error,
+			rb_sprintf("(%"PRIsVALUE", %"PRIsVALUE")", rb_in, rb_out));
+	}
+
+	RB_GC_GUARD(self);
+	return INT2NUM(args.count);
+}
+#endif
+
+/*
+ * Document-method: Rinku::Linker#stream
+ *
+ * call-seq:
+ *  stream
+ *
+ * Returns a new Rinku::Stream that autolinks a document given in pieces
+ * with the options of this linker.
+ */
+static VALUE
+rb_linker_stream(VALUE self)
+{
+	struct rinku_linker *linker = get_linker(self);
+	struct rinku_linker_stream *stream;
+	VALUE rb_stream;
+
+	rb_stream = TypedData_Make_Struct(rb_cStream, struct rinku_linker_stream,
+		&rinku_stream_type, stream);
+
+	stream->rb_linker = self;
+	stream->stream = rinku_stream_new(&linker->config, NULL, NULL);
+
+	if (stream->stream == NULL)
+		rb_memerror();
+
+	return rb_stream;
+}
+
+static struct rinku_linker_stream *
+get_stream(VALUE self)
+{
+	struct rinku_linker_stream *stream;
+	TypedData_Get_Struct(self, struct rinku_linker_stream,
+		&rinku_stream_type, stream);
+	return stream;
+}
+
+/*
+ * Pieces of a document can split a multibyte character, so only the
+ * encoding itself is checked here; every piece must share it.
+ */
+static void
+stream_check_encoding(struct rinku_linker_stream *stream, VALUE rb_text)
+{
+	rb_encoding *encoding;
+
+	Check_Type(rb_text, T_STRING);
+	encoding = rb_enc_get(rb_text);
+
+	if (!rb_enc_asciicompat(encoding))
+		rb_raise(rb_eArgError, "Invalid encoding");
+
+	if (stream->encoding == NULL)
+		stream->encoding = encoding;
+	else if (stream->encoding != encoding)
+		rb_raise(rb_eArgError, "encoding mismatch");
+}
+
+/*
+ * Document-method: Rinku::Stream#feed
+ *
+ * call-seq:
+ *  feed(text)
+ *
+ * Appends the next piece of the document and returns the output that is
+ * ready so far, which may be empty. Text is held back until the next
+ * point where it can be written out safely, usually the next whitespace
+ * outside of a tag.
+ */
+static VALUE
+rb_stream_feed(VALUE self, VALUE rb_text)
+{
+	struct rinku_linker_stream *stream = get_stream(self);
+	VALUE result = Qnil;
+	size_t pos = 0;
+
+	stream_check_encoding(stream, rb_text);
+
+	/* one output buffer can't grow past BUFFER_MAX_ALLOC_SIZE, so
+	 * long pieces are fed in slices, each with its own */
+	do {
+		struct rstring_output output;
+		size_t len = (size_t)RSTRING_LEN(rb_text) - pos;
+		VALUE slice;
+		int count;
+
+		if (len > RINKU_STREAM_SLICE)
+			len = RINKU_STREAM_SLICE;
+
+		rstring_output_init(&output, stream->encoding, false);
+		count = rinku_stream_feed(stream->stream, &output.ob,
+			(const uint8_t *)RSTRING_PTR(rb_text) + pos, len);
+
+		slice = rstring_output_finish(&output);
+		if (count < 0)
+			rb_memerror();
+
+		if (NIL_P(result))
+			result = slice;
+		else
+			rb_str_buf_append(result, slice);
+
+		pos += len;
+	} while (pos < (size_t)RSTRING_LEN(rb_text));
+
+	RB_GC_GUARD(rb_text);
+	return result;
+}
+
+/*
+ * Document-method: Rinku::Stream#finish
+ *
+ * call-seq:
+ *  finish
+ *
+ * Returns the rest of the output, once the whole document has been fed.
+ * The stream can be used for another document afterwards.
+ */
+static VALUE
+rb_stream_finish(VALUE self)
+{
+	struct rinku_linker_stream *stream = get_stream(self);
+	struct rstring_output output;
+	rb_encoding *encoding;
+
+	encoding = stream->encoding ? stream->encoding : rb_usascii_encoding();
+	stream->encoding = NULL;
+
+	rstring_output_init(&output, encoding, false);
+	rinku_stream_finish(stream->stream, &output.ob);
+
+	return rstring_output_finish(&output);
+}
+
+void RUBY_EXPORT Init_rinku()
+{
+#ifdef RB_EXT_RACTOR_SAFE
+	RB_EXT_RACTOR_SAFE(true);
+#endif
+
+	rinku_config_init(&g_default_config, AUTOLINK_ALL, 0, NULL, SKIP_TAGS);
+
+	id_all = rb_intern("all");
+	id_email_addresses = rb_intern("email_addresses");
+	id_urls = rb_intern("urls");
+	id_call = rb_intern("call");
+	id_link_kinds[RINKU_LINK_WWW] = rb_intern("www");
+	id_link_kinds[RINKU_LINK_EMAIL] = rb_intern("email");
+	id_link_kinds[RINKU_LINK_URL] = rb_intern("url");
+
+	rb_mRinku = rb_define_module("Rinku");
+	rb_define_module_function(rb_mRinku, "auto_link", rb_rinku_autolink, -1);
+	rb_define_module_function(rb_mRinku, "auto_link_many", rb_rinku_autolink_many, -1);
+	rb_define_module_function(rb_mRinku, "extract_links", rb_rinku_extract_links, -1);
+	rb_define_module_function(rb_mRinku, "stats", rb_rinku_stats, 0);
+	rb_define_module_function(rb_mRinku, "reset_stats", rb_rinku_reset_stats, 0);
+	rb_define_module_function(rb_mRinku, "cache_size=", rb_rinku_set_cache_size, 1);
+	rb_define_module_function(rb_mRinku, "cache_size", rb_rinku_cache_size, 0);
+	rb_define_module_function(rb_mRinku, "cache_stats", rb_rinku_cache_stats, 0);
+	rb_define_const(rb_mRinku, "AUTOLINK_SHORT_DOMAINS", INT2FIX(AUTOLINK_SHORT_DOMAINS));
+	rb_define_const(rb_mRinku, "ESCAPE_HTML", INT2FIX(RINKU_ESCAPE_HTML));
+
+	rb_cLinker = rb_define_class_under(rb_mRinku, "Linker", rb_cObject);
+	rb_define_alloc_func(rb_cLinker, rb_linker_alloc);
+	rb_define_private_method(rb_cLinker, "compile", rb_linker_compile, 9);
+	rb_define_method(rb_cLinker, "auto_link", rb_linker_autolink, -1);
+	rb_define_method(rb_cLinker, "auto_link_limited", rb_linker_autolink_limited, -1);
+	rb_define_method(rb_cLinker, "auto_link_many", rb_linker_autolink_many, -1);
+	rb_define_method(rb_cLinker, "extract_links", rb_linker_extract_links, 1);
+	rb_define_method(rb_cLinker, "relink", rb_linker_relink, -1);
+#ifdef RINKU_HAVE_FILES
+	rb_define_method(rb_cLinker, "auto_link_file", rb_linker_autolink_file, 2);
+#else
+	rb_define_method(rb_cLinker, "auto_link_file", rb_f_notimplement, -1);
+#endif
+	rb_define_method(rb_cLinker, "stream", rb_linker_stream, 0);
+
+	rb_cStream = rb_define_class_under(rb_mRinku, "Stream", rb_cObject);
+	rb_undef_alloc_func(rb_cStream);
+	rb_define_method(rb_cStream, "feed", rb_stream_feed, 1);
+	rb_define_method(rb_cStream, "finish", rb_stream_finish, 0);
+}
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || \
+	(defined(__i386__) && defined(__SSE2__))
+#	define RINKU_SCAN_SSE2 1
+#	include <emmintrin.h>
+#	if defined(__GNUC__)
+#		define RINKU_SCAN_AVX2 1
+#		include <immintrin.h>
+#	endif
+#elif defined(__aarch64__)
+#	define RINKU_SCAN_NEON 1
+#	include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+static inline int scan_ctz(uint32_t v)
+{
+	unsigned long idx;
+	_BitScanForward(&idx, v);
+	return (int)idx;
+}
+#else
+#	define scan_ctz(v) __builtin_ctz(v)
+#endif
+
+static size_t
+scan_scalar(const struct rinku_scan_set *set,
+	const uint8_t *text, size_t pos, size_t size)
+{
+	const char *table = set->table;
+
+	while (pos < size && table[text[pos]] == 0)
+		pos++;
+
+	return pos;
+}
+
+#ifdef RINKU_SCAN_SSE2
+static size_t
+scan_sse2(const struct rinku_scan_set *set,
+	const uint8_t *text, size_t pos, size_t size)
+{
+	__m128i needles[RINKU_SCAN_MAX_NEEDLES];
+	int n;
+
+	for (n = 0; n < set->count; ++n)
+		needles[n] = _mm_set1_epi8((char)set->needles[n]);
+
+	while (pos + 16 <= size) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(text + pos));
+		__m128i hit = _mm_cmpeq_epi8(chunk, needles[0]);
+		uint32_t mask;
+
+		for (n = 1; n < set->count; ++n)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, needles[n]));
+
+		mask = (uint32_t)_mm_movemask_epi8(hit);
+		if (mask)
+			return pos + scan_ctz(mask);
+
+		pos += 16;
+	}
+
+	return scan_scalar(set, text, pos, size);
+}
+#endif
+
+#ifdef RINKU_SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const struct rinku_scan_set *set,
+	const uint8_t *text, size_t pos, size_t size)
+{
+	__m256i needles[RINKU_SCAN_MAX_NEEDLES];
+	int n;
+
+	for (n = 0; n < set->count; ++n)
+		needles[n] = _mm256_set1_epi8((char)set->needles[n]);
+
+	while (pos + 32 <= size) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(text + pos));
+		__m256i hit = _mm256_cmpeq_epi8(chunk, needles[0]);
+		uint32_t mask;
+
+		for (n = 1; n < set->count; ++n)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, needles[n]));
+
+		mask = (uint32_t)_mm256_movemask_epi8(hit);
+		if (mask)
+			return pos + scan_ctz(mask);
+
+		pos += 32;
+	}
+
+	/* the compiler doesn't clear the upper halves before the tail
+	 * call, and SSE code running with them dirty is much slower */
+	_mm256_zeroupper();
+	return scan_sse2(set, text, pos, size);
+}
+#endif
+
+#ifdef RINKU_SCAN_NEON
+static size_t
+scan_neon(const struct rinku_scan_set *set,
+	const uint8_t *text, size_t pos, size_t size)
+{
+	uint8x16_t needles[RINKU_SCAN_MAX_NEEDLES];
+	int n;
+
+	for (n = 0; n < set->count; ++n)
+		needles[n] = vdupq_n_u8(set->needles[n]);
+
+	while (pos + 16 <= size) {
+		uint8x16_t chunk = vld1q_u8(text + pos);
+		uint8x16_t hit = vceqq_u8(chunk, needles[0]);
+
+		for (n = 1; n < set->count; ++n)
+			hit = vorrq_u8(hit, vceqq_u8(chunk, needles[n]));
+
+		if (vmaxvq_u8(hit)) {
+			/* narrow each byte lane to a nibble so the lowest set
+			 * nibble gives the offset of the first hit */
+			uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+			return pos + (__builtin_ctzll(mask) >> 2);
+		}
+
+		pos += 16;
+	}
+
+	return scan_scalar(set, text, pos, size);
+}
+#endif
+
+static rinku_scan_fn g_scan_vector;
+
+static void
+scan_detect(void)
+{
+#if defined(RINKU_SCAN_AVX2)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		g_scan_vector = &scan_avx2;
+		return;
+	}
+#endif
+#if defined(RINKU_SCAN_SSE2)
+	g_scan_vector = &scan_sse2;
+#elif defined(RINKU_SCAN_NEON)
+	g_scan_vector = &scan_neon;
+#else
+	g_scan_vector = &scan_scalar;
+#endif
+}
+
+/* The fastest scanner for this CPU, detected on first use */
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t g_scan_once = PTHREAD_ONCE_INIT;
+
+static rinku_scan_fn
+scan_select(void)
+{
+	pthread_once(&g_scan_once, scan_detect);
+	return g_scan_vector;
+}
+#else
+static rinku_scan_fn
+scan_select(void)
+{
+	if (g_scan_vector == NULL)
+		scan_detect();
+	return g_scan_vector;
+}
+#endif
+
+void
+rinku_scan_set_init(struct rinku_scan_set *set, const char *table)
+{
+	int c;
+
+	memset(set, 0, sizeof(*set));
+	set->table = table;
+
+	for (c = 0; c < 256; ++c) {
+		if (table[c] == 0)
+			continue;
+
+		if (set->count == RINKU_SCAN_MAX_NEEDLES) {
+			set->find = &scan_scalar;
+			return;
+		}
+
+		set->needles[set->count++] = (uint8_t)c;
+	}
+
+	set->find = set->count ? scan_select() : &scan_scalar;
+}
+
+/*
+ * Byte class scans. Both are decided by the sign bit of each byte, so
+ * the vector versions need one compare per block: bytes below 0x21 are
+ * the only ASCII ones a signed compare against 0x21 catches, and bytes
+ * from 0x80 up all read as negative.
+ */
+#define SCAN_ONES 0x0101010101010101ULL
+#define SCAN_HIGH 0x8080808080808080ULL
+
+static inline int
+scan_is_plain(uint8_t c)
+{
+	return (uint8_t)(c - 0x21) < 0x5F;
+}
+
+size_t
+rinku_scan_plain(const uint8_t *text, size_t pos, size_t size)
+{
+#if defined(RINKU_SCAN_SSE2)
+	const __m128i limit = _mm_set1_epi8(0x21);
+
+	while (pos + 16 <= size) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(text + pos));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(chunk, limit));
+
+		if (mask)
+			return pos + scan_ctz(mask);
+
+		pos += 16;
+	}
+#elif defined(RINKU_SCAN_NEON)
+	const int8x16_t limit = vdupq_n_s8(0x21);
+
+	while (pos + 16 <= size) {
+		uint8x16_t hit = vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(text + pos)), limit);
+
+		if (vmaxvq_u8(hit)) {
+			uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+			return pos + (__builtin_ctzll(mask) >> 2);
+		}
+
+		pos += 16;
+	}
+#else
+	while (pos + 8 <= size) {
+		uint64_t word;
+		memcpy(&word, text + pos, 8);
+
+		/* any byte from 0x80 up, or (with false positives only after
+		 * a real one) any byte below 0x21 */
+		if ((word | ((word - SCAN_ONES * 0x21) & ~word)) & SCAN_HIGH)
+			break;
+
+		pos += 8;
+	}
+#endif
+
+	while (pos < size && scan_is_plain(text[pos]))
+		pos++;
+
+	return pos;
+}
+
+size_t
+rinku_scan_ascii(const uint8_t *text, size_t pos, size_t size)
+{
+#if defined(RINKU_SCAN_SSE2)
+	while (pos + 16 <= size) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(text + pos));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(chunk);
+
+		if (mask)
+			return pos + scan_ctz(mask);
+
+		pos += 16;
+	}
+#elif defined(RINKU_SCAN_NEON)
+	while (pos + 16 <= size) {
+		if (vmaxvq_u8(vld1q_u8(text + pos)) >= 0x80)
+			break;
+
+		pos += 16;
+	}
+#else
+	while (pos + 8 <= size) {
+		uint64_t word;
+		memcpy(&word, text + pos, 8);
+
+		if (word & SCAN_HIGH)
+			break;
+
+		pos += 8;
+	}
+#endif
+
+	while (pos < size && text[pos] < 0x80)
+		pos++;
+
+	return pos;
+}
+
+/*
+ * UTF-8 scan, a block at a time: a block is well-formed when exactly the
+ * bytes that follow a lead byte (0xC0 up) within its length are
+ * continuation bytes (0x80-0xBF), none is 0xF8 or above, and no three
+ * bytes spell U+FFFD. The bytes before `pos` end whole sequences, so they
+ * never call for a continuation and the first block can read them as 0.
+ */
+static inline size_t
+scan_utf8_boundary(const uint8_t *text, size_t end)
+{
+	if (text[end - 1] >= 0xC0)
+		return end - 1;
+	if (text[end - 2] >= 0xE0)
+		return end - 2;
+	if (text[end - 3] >= 0xF0)
+		return end - 3;
+	return end;
+}
+
+size_t
+rinku_scan_utf8(const uint8_t *text, size_t pos, size_t size)
+{
+	size_t good = pos;
+#if defined(RINKU_SCAN_SSE2)
+	const __m128i cont_max = _mm_set1_epi8(-64);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = pos;
+
+	while (i + 16 <= size) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i p1, p2, p3, must, bad;
+
+		if (i == pos) {
+			p1 = _mm_slli_si128(cur, 1);
+			p2 = _mm_slli_si128(cur, 2);
+			p3 = _mm_slli_si128(cur, 3);
+		} else {
+			p1 = _mm_loadu_si128((const __m128i *)(text + i - 1));
+			p2 = _mm_loadu_si128((const __m128i *)(text + i - 2));
+			p3 = _mm_loadu_si128((const __m128i *)(text + i - 3));
+		}
+
+		must = _mm_or_si128(_mm_subs_epu8(p1, _mm_set1_epi8((char)0xBF)),
+			_mm_or_si128(_mm_subs_epu8(p2, _mm_set1_epi8((char)0xDF)),
+				_mm_subs_epu8(p3, _mm_set1_epi8((char)0xEF))));
+
+		/* a continuation where none is due, or none where one is */
+		bad = _mm_xor_si128(_mm_cmplt_epi8(cur, cont_max),
+			_mm_xor_si128(_mm_cmpeq_epi8(must, zero), _mm_set1_epi8(-1)));
+
+		bad = _mm_or_si128(bad, _mm_xor_si128(_mm_set1_epi8(-1),
+			_mm_cmpeq_epi8(_mm_subs_epu8(cur, _mm_set1_epi8((char)0xF7)), zero)));
+
+		bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(cur, _mm_set1_epi8((char)0xBD)),
+			_mm_and_si128(_mm_cmpeq_epi8(p1, _mm_set1_epi8((char)0xBF)),
+				_mm_cmpeq_epi8(p2, _mm_set1_epi8((char)0xEF)))));
+
+		if (_mm_movemask_epi8(bad))
+			break;
+
+		i += 16;
+		good = scan_utf8_boundary(text, i);
+	}
+#elif defined(RINKU_SCAN_NEON)
+	uint8x16_t prev = vdupq_n_u8(0);
+	size_t i = pos;
+
+	while (i + 16 <= size) {
+		uint8x16_t cur = vld1q_u8(text + i);
+		uint8x16_t p1 = vextq_u8(prev, cur, 15);
+		uint8x16_t p2 = vextq_u8(prev, cur, 14);
+		uint8x16_t p3 = vextq_u8(prev, cur, 13);
+		uint8x16_t must, bad;
+
+		must = vorrq_u8(vqsubq_u8(p1, vdupq_n_u8(0xBF)),
+			vorrq_u8(vqsubq_u8(p2, vdupq_n_u8(0xDF)),
+				vqsubq_u8(p3, vdupq_n_u8(0xEF))));
+
+		/* a continuation where none is due, or none where one is */
+		bad = veorq_u8(vcltq_s8(vreinterpretq_s8_u8(cur), vdupq_n_s8(-64)),
+			vtstq_u8(must, must));
+
+		bad = vorrq_u8(bad, vcgeq_u8(cur, vdupq_n_u8(0xF8)));
+		bad = vorrq_u8(bad, vandq_u8(vceqq_u8(cur, vdupq_n_u8(0xBD)),
+			vandq_u8(vceqq_u8(p1, vdupq_n_u8(0xBF)), vceqq_u8(p2, vdupq_n_u8(0xEF)))));
+
+		if (vmaxvq_u8(bad))
+			break;
+
+		prev = cur;
+		i += 16;
+		good = scan_utf8_boundary(text, i);
+	}
+#endif
+
+	return good;
+}
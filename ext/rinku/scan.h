@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RINKU_SCAN_H
+#define RINKU_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RINKU_SCAN_MAX_NEEDLES 8
+
+struct rinku_scan_set;
+
+typedef size_t (*rinku_scan_fn)(const struct rinku_scan_set *,
+	const uint8_t *, size_t, size_t);
+
+/* struct rinku_scan_set: the set of trigger bytes for the main loop,
+ * built from a 256-entry table (nonzero = trigger) */
+struct rinku_scan_set {
+	const char *table;
+	uint8_t needles[RINKU_SCAN_MAX_NEEDLES];
+	int count;
+	rinku_scan_fn find;
+};
+
+/* rinku_scan_set_init: collects the trigger bytes in `table` and picks
+ * the fastest scanner available on this CPU */
+void
+rinku_scan_set_init(struct rinku_scan_set *set, const char *table);
+
+/* rinku_scan: returns the offset of the first trigger byte in
+ * text[pos..size), or `size` if there is none */
+static inline size_t
+rinku_scan(const struct rinku_scan_set *set,
+	const uint8_t *text, size_t pos, size_t size)
+{
+	return set->find(set, text, pos, size);
+}
+
+/* rinku_scan_plain: returns the offset of the first byte in
+ * text[pos..size) that isn't printable ASCII (0x21-0x7F): whitespace,
+ * a control byte or part of a UTF-8 sequence; `size` if there is none */
+size_t
+rinku_scan_plain(const uint8_t *text, size_t pos, size_t size);
+
+/* rinku_scan_ascii: returns the offset of the first byte in
+ * text[pos..size) that is 0x80 or above, or `size` if there is none */
+size_t
+rinku_scan_ascii(const uint8_t *text, size_t pos, size_t size);
+
+/* rinku_scan_utf8: returns an offset in text[pos..size), which must start
+ * a character, before which the text is whole UTF-8 sequences (each lead
+ * byte followed by as many continuation bytes as it calls for) without
+ * U+FFFD. It checks blocks at a time and stops at the first one it can't
+ * vouch for, so it can return well short of the first bad byte, or `pos`
+ * on CPUs without vector instructions. */
+size_t
+rinku_scan_utf8(const uint8_t *text, size_t pos, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2016, GitHub, Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef RINKU_STATS_H
+#define RINKU_STATS_H
+
+/*
+ * Counters for the hot paths of the autolinker. They are only compiled
+ * in when building with RINKU_STATS (`extconf.rb --enable-stats`);
+ * otherwise RINKU_STAT() compiles to nothing.
+ *
+ * The counters are kept per thread, so they add up everything the
+ * calling thread has linked since it last reset them.
+ */
+#ifdef RINKU_STATS
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_MSC_VER)
+#	define RINKU_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#	define RINKU_THREAD_LOCAL _Thread_local
+#else
+#	define RINKU_THREAD_LOCAL __thread
+#endif
+
+struct rinku_stats {
+	size_t bytes_scanned;
+	size_t tag_triggers;		/* '<' the scan stopped at */
+	size_t skipped_tag_bytes;	/* bytes inside tags and skipped elements */
+	size_t attempts[4];		/* detector calls, by rinku_link_kind */
+	size_t matches[4];		/* ... and the ones that found a link */
+	size_t buf_reallocs;
+	uint64_t callback_ns;		/* time spent in link text callbacks */
+};
+
+extern RINKU_THREAD_LOCAL struct rinku_stats rinku_thread_stats;
+
+#define RINKU_STAT(field, n) (rinku_thread_stats.field += (n))
+
+/* Adds the counters of the threads rinku_autolink_parallel starts to the
+ * thread that called it */
+static inline void
+rinku_stats_add(struct rinku_stats *stats, const struct rinku_stats *more)
+{
+	int i;
+
+	stats->bytes_scanned += more->bytes_scanned;
+	stats->tag_triggers += more->tag_triggers;
+	stats->skipped_tag_bytes += more->skipped_tag_bytes;
+
+	for (i = 0; i < 4; ++i) {
+		stats->attempts[i] += more->attempts[i];
+		stats->matches[i] += more->matches[i];
+	}
+
+	stats->buf_reallocs += more->buf_reallocs;
+	stats->callback_ns += more->callback_ns;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#else
+
+#define RINKU_STAT(field, n) ((void)0)
+
+#endif
+
+#endif
@@ -1,6 +1,18 @@
 require 'rinku'
 
 module RailsRinku
+  # The link attributes made from each html options hash seen so far are
+  # kept per thread (so helpers work in any Ractor); most apps only ever
+  # pass a handful of them. Only hashes of plain values are kept, with
+  # their strings frozen, so a stored key can't change under the table.
+  # Subclasses of String such as SafeBuffer are never kept: they compare
+  # equal to a String but aren't escaped the same.
+  TAG_OPTIONS_KEY = :__rinku_tag_options
+  TAG_OPTIONS_LIMIT = 64
+
+  # Rails >= 5.1 builds tag options through `tag_builder`
+  TAG_BUILDER = Gem::Version.new(Rails.version) >= Gem::Version.new("5.1")
+
   def rinku_auto_link(text, *args, &block)
     return '' if text.blank?
 
@@ -11,24 +23,57 @@ module RailsRinku
       options[:skip] = args[2]
     end
     options.reverse_merge!(:link => :all, :html => {})
-    text = h(text) unless text.html_safe?
 
-    tag_options_method = if Gem::Version.new(Rails.version) >= Gem::Version.new("5.1")
-      # Rails >= 5.1
-      tag_builder.method(:tag_options)
-    else
-      # Rails <= 5.0
-      method(:tag_options)
+    # Plain text is escaped by Rinku as it's linked, in the same pass.
+    # Blocks are given the link text escaped, so they still need `h`.
+    flags = 0
+    unless text.html_safe?
+      if block
+        text = h(text)
+      else
+        flags = Rinku::ESCAPE_HTML
+      end
     end
 
     Rinku.auto_link(
       text,
       options[:link],
-      tag_options_method.call(options[:html]),
+      rinku_tag_options(options[:html]),
       options[:skip],
+      flags,
       &block
     ).html_safe
   end
+
+  private
+
+  def rinku_tag_options(html)
+    return nil if html.empty?
+    return rinku_render_tag_options(html) unless
+      html.all? { |key, value| rinku_plain_option?(key) && rinku_plain_option?(value) }
+
+    memo = (Thread.current[TAG_OPTIONS_KEY] ||= {})
+    memo.fetch(html) do
+      memo.clear if memo.size >= TAG_OPTIONS_LIMIT
+      key = Hash[html.map { |k, v| [k, v.instance_of?(String) ? v.dup.freeze : v] }].freeze
+      memo[key] = rinku_render_tag_options(html).freeze
+    end
+  end
+
+  def rinku_render_tag_options(html)
+    if TAG_BUILDER
+      # Rails >= 5.1
+      tag_builder.tag_options(html)
+    else
+      # Rails <= 5.0
+      tag_options(html)
+    end
+  end
+
+  def rinku_plain_option?(value)
+    value.nil? || value == true || value == false ||
+      value.instance_of?(String) || value.is_a?(Symbol) || value.is_a?(Numeric)
+  end
 end
 
 module ActionView::Helpers::TextHelper
@@ -2,10 +2,80 @@ module Rinku
   VERSION = "2.0.6"
 
   class << self
-    attr_accessor :skip_tags
+    attr_reader :skip_tags
+
+    # The list is kept as a frozen copy, so it can be read from any Ractor
+    def skip_tags=(tags)
+      if tags.is_a?(Array)
+        tags = tags.map { |tag| tag.is_a?(String) && !tag.frozen? ? tag.dup.freeze : tag }.freeze
+      end
+      @skip_tags = tags
+    end
   end
 
   self.skip_tags = nil
 end
 
 require 'rinku.so'
+
+module Rinku
+  # Autolinks the file at `in_path` into `out_path` without reading it
+  # into a String; takes the same options as Rinku::Linker.new and
+  # returns the number of links.
+  #
+  #     Rinku.auto_link_file('post.html', 'post.linked.html', link_attr: 'rel="nofollow"')
+  def self.auto_link_file(in_path, out_path, **options)
+    Linker.new(**options).auto_link_file(in_path, out_path)
+  end
+
+  # A reusable set of `auto_link` options. The mode, link attributes and
+  # skip tags are parsed once, when the linker is created, instead of on
+  # every call.
+  #
+  #     linker = Rinku::Linker.new(mode: :urls, link_attr: 'rel="nofollow"')
+  #     linker.auto_link(text)
+  #
+  # `skip_tags` defaults to the value of `Rinku.skip_tags` at the time the
+  # linker is created. `schemes` lists the protocols linked in URLs such
+  # as `ssh://host`, by name; `nil` means `http`, `https` and `ftp`. With
+  # `frozen_link_text: true`, blocks are given frozen link strings, which
+  # are handed back without being checked again when the block returns
+  # them unchanged. With `threads:`, large texts autolinked without a
+  # block are split over that many threads.
+  #
+  # `max_links` and `max_work` bound the cost of each call: once it has
+  # made that many links, or its link detectors have read that many
+  # bytes, the rest of the text is left as it is. `auto_link_limited`
+  # tells when that happened.
+  class Linker
+    def initialize(mode: :all, link_attr: nil, skip_tags: Rinku.skip_tags, schemes: nil,
+                   flags: 0, frozen_link_text: false, threads: 1,
+                   max_links: nil, max_work: nil)
+      compile(mode, link_attr, skip_tags, schemes, flags, frozen_link_text, threads,
+              max_links, max_work)
+      freeze
+    end
+
+    # Autolinks a document that arrives in pieces, such as a file read in
+    # chunks or a streamed response body, and yields the output as soon as
+    # it's ready. `chunks` can be anything that responds to `each`; the
+    # result is the same as autolinking all the chunks joined together.
+    #
+    #     linker.auto_link_stream(response.enum_for(:read_body)) do |html|
+    #       out.write(html)
+    #     end
+    def auto_link_stream(chunks)
+      return enum_for(__method__, chunks) unless block_given?
+
+      stream = self.stream
+      chunks.each do |chunk|
+        html = stream.feed(chunk)
+        yield html unless html.empty?
+      end
+
+      html = stream.finish
+      yield html unless html.empty?
+      nil
+    end
+  end
+end
@@ -4,6 +4,8 @@ $LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
 require 'minitest/autorun'
 require 'cgi'
 require 'uri'
+require 'timeout'
+require 'tmpdir'
 require 'rinku'
 
 class RinkuAutoLinkTest < Minitest::Test
@@ -30,6 +32,7 @@ class RinkuAutoLinkTest < Minitest::Test
     assert_nil Rinku.skip_tags
     Rinku.skip_tags = ['pre']
     assert_equal Rinku.skip_tags, ['pre']
+    assert Rinku.skip_tags.frozen?
 
     Rinku.skip_tags = ['pa']
     url = 'This is just a <pa>http://www.pokemon.com</pa> test'
@@ -39,6 +42,23 @@ class RinkuAutoLinkTest < Minitest::Test
     refute_equal Rinku.auto_link(url), url
   end
 
+  def test_ractors
+    skip "no Ractors in this Ruby" unless defined?(Ractor)
+
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    linker = Ractor.make_shareable(Rinku::Linker.new(link_attr: 'rel="x"'))
+    text = "www.pokemon.com <pre>www.skip.me</pre> ash@pokemon.com"
+
+    ractor = Ractor.new(linker, text) do |l, t|
+      [Rinku.auto_link(t), l.auto_link(t), Rinku.extract_links(t), Rinku.auto_link(t) { |link| link.upcase }]
+    end
+
+    assert_equal [Rinku.auto_link(text), linker.auto_link(text), Rinku.extract_links(text),
+      Rinku.auto_link(text) { |link| link.upcase }], ractor.take
+  ensure
+    Warning[:experimental] = experimental if defined?(Ractor)
+  end
+
   def test_auto_link_with_single_trailing_punctuation_and_space
     url = "http://www.youtube.com"
     url_result = generate_result(url)
@@ -426,6 +446,15 @@ This is just a test. <a href="http://www.pokemon.com">http://www.pokemon.com</a>
     assert_linked "〈<a href=\"http://example.com/\">http://example.com/</a>〉", "〈http://example.com/〉"
   end
 
+  def test_trailing_brackets_and_punctuation
+    url = "http://www.pokemon.com/Pikachu_(Electric)"
+    assert_linked "(#{generate_result(url)}).).;", "(#{url}).).;"
+    assert_linked "#{generate_result(url)}&amp;&quot;)!", "#{url}&amp;&quot;)!"
+
+    # trimming gives up after seven rounds
+    assert_linked "#{generate_result("http://a.com/x)))")}#{")" * 7}", "http://a.com/x#{")" * 10}"
+  end
+
   def test_urls_with_quotes
     assert_linked "'<a href=\"http://example.com\">http://example.com</a>'", "'http://example.com'"
     assert_linked "\"<a href=\"http://example.com\">http://example.com</a>\"\"", "\"http://example.com\"\""
@@ -439,6 +468,440 @@ This is just a test. <a href="http://www.pokemon.com">http://www.pokemon.com</a>
     assert_linked "<a href=\"http://foo_bar.xyz.com\">http://foo_bar.xyz.com</a>", "http://foo_bar.xyz.com"
   end
 
+  def test_large_inputs_without_gvl
+    chunk = "Visit http://www.pokemon.com or mail ash@pokemon.com now. <pre>www.skip.me</pre>\n"
+    text = chunk * 2000
+    expected = Rinku.auto_link(chunk) * 2000
+
+    threads = 4.times.map { Thread.new { Rinku.auto_link(text, :all, nil, ["pre"]) } }
+    threads.each { |t| assert_equal expected, t.value }
+
+    plain = "no links in here, just words " * 4000
+    assert_same plain, Rinku.auto_link(plain)
+  end
+
+  def test_linker_matches_auto_link
+    text = "Go to http://www.pokemon.com, <pre>www.skip.me</pre> or mail ash@pokemon.com"
+
+    linker = Rinku::Linker.new
+    assert_equal Rinku.auto_link(text), linker.auto_link(text)
+    assert linker.frozen?
+
+    linker = Rinku::Linker.new(mode: :urls, link_attr: ' target="_blank"', skip_tags: ["b"])
+    assert_equal Rinku.auto_link(text, :urls, ' target="_blank"', ["b"]), linker.auto_link(text)
+
+    linker = Rinku::Linker.new(flags: Rinku::AUTOLINK_SHORT_DOMAINS)
+    assert_equal Rinku.auto_link("http://google", nil, nil, nil, Rinku::AUTOLINK_SHORT_DOMAINS),
+      linker.auto_link("http://google")
+
+    assert_equal Rinku.auto_link(text) { |l| l.upcase }, Rinku::Linker.new.auto_link(text) { |l| l.upcase }
+  end
+
+  def test_linker_validates_options
+    assert_raises(TypeError) { Rinku::Linker.new(mode: :pokemon) }
+    assert_raises(TypeError) { Rinku::Linker.new(skip_tags: [1]) }
+    assert_raises(RuntimeError) { Rinku::Linker.new.send(:compile, :all, nil, nil, nil, 0, false, 1, nil, nil) }
+    assert_raises(RuntimeError) { Rinku::Linker.allocate.auto_link("www.pokemon.com") }
+  end
+
+  def test_linker_schemes
+    text = "clone ssh://git.pokemon.com/x or get http://pokemon.com or Git://pokemon.com"
+    linker = Rinku::Linker.new(schemes: ["ssh", "git"])
+
+    assert_equal Rinku.auto_link(text), Rinku::Linker.new.auto_link(text)
+    assert_equal "clone <a href=\"ssh://git.pokemon.com/x\">ssh://git.pokemon.com/x</a> or get http://pokemon.com " +
+      "or <a href=\"Git://pokemon.com\">Git://pokemon.com</a>", linker.auto_link(text)
+    assert_equal "go to <a href=\"http://www.pokemon.com\">www.pokemon.com</a>", linker.auto_link("go to www.pokemon.com")
+    assert_equal "javascript://pokemon.com", Rinku::Linker.new(schemes: []).auto_link("javascript://pokemon.com")
+
+    assert_raises(ArgumentError) { Rinku::Linker.new(schemes: ["svn+ssh"]) }
+    assert_raises(ArgumentError) { Rinku::Linker.new(schemes: [""]) }
+    assert_raises(ArgumentError) { Rinku::Linker.new(schemes: ["a"] * 33) }
+    assert_raises(TypeError) { Rinku::Linker.new(schemes: [:ssh]) }
+  end
+
+  def test_linker_threads
+    piece = "See http://pokemon.com/(Pikachu) or <pre>www.skip.me </pre> mail ash@pokemon.com, " +
+      "<a href=\"x\">www.not.me</a> 日本 www.pokémon.com!\n"
+    text = piece * 20_000
+
+    [2, 3, 8].each do |threads|
+      linker = Rinku::Linker.new(threads: threads)
+      assert_equal Rinku.auto_link(text), linker.auto_link(text)
+      assert_equal Rinku.auto_link(text, :urls), Rinku::Linker.new(mode: :urls, threads: threads).auto_link(text)
+      assert_equal Rinku.auto_link(text) { |l| l.upcase }, linker.auto_link(text) { |l| l.upcase }
+    end
+
+    assert_raises(ArgumentError) { Rinku::Linker.new(threads: 0) }
+    assert_raises(ArgumentError) { Rinku::Linker.new(threads: 33) }
+  end
+
+  def test_linker_budget
+    text = "a http://a.com b www.b.com c ash@pokemon.com d http://d.com"
+    linked = Rinku.auto_link(text)
+
+    html, truncated = Rinku::Linker.new(max_links: 2).auto_link_limited(text)
+    assert truncated
+    assert_equal Rinku.auto_link("a http://a.com b www.b.com") + " c ash@pokemon.com d http://d.com", html
+    assert_equal html, Rinku::Linker.new(max_links: 2).auto_link(text)
+
+    assert_equal [linked, false], Rinku::Linker.new(max_links: 4).auto_link_limited(text)
+    assert_equal [linked, false], Rinku::Linker.new(max_work: 1_000).auto_link_limited(text)
+    assert_equal [linked, false], Rinku::Linker.new.auto_link_limited(text)
+
+    # the email detector reads a few bytes around every '@'
+    hostile = "a@" * 65536 + "b.com"
+    html, truncated = Rinku::Linker.new(max_work: 100_000).auto_link_limited(hostile)
+    assert truncated
+    assert_equal hostile, html
+    assert_equal [Rinku.auto_link(hostile), false],
+      Rinku::Linker.new(max_work: 10_000_000).auto_link_limited(hostile)
+
+    # every "www." reads the domain to its end before the underscores
+    # turn it down
+    hostile = "www." * 20_000 + "a_b.c_d"
+    html, truncated = Rinku::Linker.new(max_work: 100_000).auto_link_limited(hostile)
+    assert truncated
+    assert_equal hostile, html
+
+    assert_raises(ArgumentError) { Rinku::Linker.new(max_links: 0) }
+    assert_raises(ArgumentError) { Rinku::Linker.new(max_work: -1) }
+    assert_raises(ArgumentError) { Rinku::Linker.new(max_links: 10, threads: 2) }
+  end
+
+  def test_auto_link_file
+    skip "no auto_link_file on this platform" unless Rinku::Linker.new.respond_to?(:auto_link_file)
+
+    piece = "See http://pokemon.com/(Pikachu) or <pre>www.skip.me </pre> mail ash@pokemon.com, " +
+      "<a href=\"x\">www.not.me</a> 日本 www.pokémon.com!\n"
+
+    Dir.mktmpdir do |dir|
+      input, output = File.join(dir, "in.html"), File.join(dir, "out.html")
+
+      ["", "no links here\n", piece, piece * 20_000, "www.pokemon.com" * 300].each do |text|
+        File.binwrite(input, text)
+        expected = Rinku.auto_link(text.dup)
+
+        assert_equal Rinku.extract_links(text).size, Rinku.auto_link_file(input, output)
+        assert_equal expected.b, File.binread(output)
+      end
+
+      File.binwrite(input, piece)
+      linker = Rinku::Linker.new(mode: :urls, link_attr: 'rel="nofollow"')
+      linker.auto_link_file(input, output)
+      assert_equal Rinku.auto_link(piece, :urls, 'rel="nofollow"').b, File.binread(output)
+
+      assert_raises(ArgumentError) { Rinku.auto_link_file(input, input) }
+      assert_equal piece.b, File.binread(input)
+      assert_raises(Errno::ENOENT) { Rinku.auto_link_file(File.join(dir, "missing"), output) }
+
+      # bad input fails like auto_link, leaving the output as it was
+      kept = File.join(dir, "keep.html")
+      File.binwrite(kept, "earlier output")
+      ["www.pokemon.com \xff", "\xed\xa0\x80", "\xc0\xaf", "\xf4\x90\x80\x80", "\xe6\x97"].each do |bad|
+        File.binwrite(input, piece + bad)
+        File.delete(output) if File.exist?(output)
+        assert_raises(ArgumentError) { Rinku.auto_link(piece + bad) }
+        assert_raises(ArgumentError) { Rinku.auto_link_file(input, kept) }
+        assert_equal "earlier output", File.binread(kept)
+        assert_raises(ArgumentError) { Rinku.auto_link_file(input, output) }
+        refute File.exist?(output)
+      end
+      assert_equal %w(in.html keep.html), Dir.children(dir).sort
+
+      File.binwrite(input, piece + "\u{10FFFF}\u{FFFD}\u{D7FF}")
+      Rinku.auto_link_file(input, output)
+      assert_equal Rinku.auto_link(File.read(input, encoding: "UTF-8")).b, File.binread(output)
+    end
+  end
+
+  def test_result_cache
+    text = "Signature: www.pokemon.com / ash@pokemon.com"
+    plain = "no links in here"
+    before = Rinku.cache_stats
+    Rinku.cache_size = 1 << 20
+
+    expected = Rinku.auto_link(text)
+    assert_equal expected, Rinku.auto_link(text)
+    assert_equal expected, Rinku::Linker.new.auto_link(text)
+    assert_equal Rinku.auto_link(text, :urls, 'rel="nofollow"'), Rinku::Linker.new(mode: :urls, link_attr: 'rel="nofollow"').auto_link(text)
+    refute_equal expected, Rinku.auto_link(text, :urls)
+    assert_same plain, Rinku.auto_link(plain)
+    assert_same plain, Rinku.auto_link(plain)
+
+    stats = Rinku.cache_stats
+    assert_equal 4, stats[:hits] - before[:hits]
+    assert_equal 4, stats[:misses] - before[:misses]
+    assert_equal 4, stats[:entries]
+    assert_operator stats[:bytes], :<=, 1 << 20
+
+    # blocks bypass the cache
+    assert_includes Rinku.auto_link(text) { |link| link.upcase }, ">WWW.POKEMON.COM</a>"
+    assert_equal stats[:hits], Rinku.cache_stats[:hits]
+
+    # as do configs too long to be compared in full
+    long_attr = "data-x=\"#{'x' * 1024}\""
+    assert_equal Rinku.auto_link(text, :all, long_attr), Rinku.auto_link(text, :all, long_attr)
+    assert_equal stats[:misses], Rinku.cache_stats[:misses]
+
+    # configs are told apart by every option, not just what they join to
+    tagged = "<ab>www.pokemon.com</ab>"
+    assert_equal tagged, Rinku.auto_link(tagged, :all, nil, %w(ab c))
+    refute_equal tagged, Rinku.auto_link(tagged, :all, nil, %w(a bc))
+
+    Rinku.cache_size = 4096
+    40.times { |i| Rinku.auto_link("#{text} #{i}") }
+    assert_operator Rinku.cache_stats[:bytes], :<=, 4096
+    assert_operator Rinku.cache_stats[:evictions], :>, 0
+
+    assert_raises(ArgumentError) { Rinku.cache_size = -1 }
+  ensure
+    Rinku.cache_size = 0
+    assert_equal 0, Rinku.cache_stats[:entries]
+  end
+
+  def test_frozen_link_text
+    linker = Rinku::Linker.new(frozen_link_text: true)
+    text = "go to www.pokemon.com now"
+    links = []
+
+    assert_equal Rinku.auto_link(text), linker.auto_link(text) { |l| links << l; l }
+    assert_equal ["www.pokemon.com"], links
+    assert links.first.frozen?
+    assert_equal Rinku.auto_link(text) { |l| l.upcase }, linker.auto_link(text) { |l| l.upcase }
+    assert_raises(ArgumentError) { linker.auto_link(text) { |l| l.encode("UTF-16LE") } }
+  end
+
+  def test_block_cannot_change_text_being_linked
+    text = "www.pokemon.com and www.github.com " * 4
+    expected = Rinku.auto_link(text.dup)
+
+    assert_equal expected, Rinku.auto_link(text) { |l| text.replace("gone"); l }
+
+    # links share the bytes of the text, but changing them doesn't
+    text = "mail ash@pokemon.com " * 4
+    Rinku.auto_link(text) { |l| l.replace("x" * l.size) }
+    assert_equal "mail ash@pokemon.com " * 4, text
+  end
+
+  def test_auto_link_many
+    texts = ["www.pokemon.com", "nothing here", "mail ash@pokemon.com", "<a>www.skip.me</a>", ""]
+    assert_equal texts.map { |t| Rinku.auto_link(t) }, Rinku.auto_link_many(texts)
+    assert_equal texts.map { |t| Rinku.auto_link(t, :urls, 'rel="x"', ["b"]) },
+      Rinku.auto_link_many(texts, :urls, 'rel="x"', ["b"])
+    assert_equal texts.map { |t| Rinku.auto_link(t) { |l| l.upcase } },
+      Rinku.auto_link_many(texts) { |l| l.upcase }
+
+    linker = Rinku::Linker.new(mode: :email_addresses)
+    assert_equal texts.map { |t| linker.auto_link(t) }, linker.auto_link_many(texts)
+
+    big = (texts * 5000).each_with_index.map { |t, i| "#{i} #{t}" }
+    assert_equal big.map { |t| Rinku.auto_link(t) }, Rinku.auto_link_many(big)
+
+    assert_raises(TypeError) { Rinku.auto_link_many("www.pokemon.com") }
+  end
+
+  def test_skip_tags_are_case_insensitive
+    html = "<PRE>www.pokemon.com</PRE> <Code class=\"x\">www.pokemon.com</cODE> www.pokemon.com"
+    expected = "<PRE>www.pokemon.com</PRE> <Code class=\"x\">www.pokemon.com</cODE> #{generate_result("www.pokemon.com", "http://www.pokemon.com")}"
+    assert_linked expected, html
+    assert_equal expected, Rinku.auto_link(html, :all, nil, ["PRE", "code"])
+  end
+
+  def test_many_skip_tags
+    tags = (1..100).map { |i| "tag#{i}" }
+    html = "<tag77>www.pokemon.com</tag77> <tag7>www.pokemon.com</tag7>"
+    assert_equal html, Rinku.auto_link(html, :all, nil, tags)
+    assert_equal html, Rinku.auto_link(html, :all, nil, tags.first(20) + ["tag77"])
+    refute_equal html, Rinku.auto_link(html, :all, nil, ["tag"])
+  end
+
+  def test_extract_links
+    text = "Go to www.pokemon.com, http://x.com/a?b or foo@bar.com. <a href='q'>www.skip.com</a>"
+    links = Rinku.extract_links(text)
+
+    assert_equal [[6, 21, :www], [23, 39, :url], [43, 54, :email]], links
+    assert_equal ["www.pokemon.com", "http://x.com/a?b", "foo@bar.com"],
+      links.map { |start, stop, _| text.byteslice(start, stop - start) }
+    assert_equal links.first(2), Rinku.extract_links(text, :urls)
+    assert_equal 4, Rinku::Linker.new(skip_tags: []).extract_links(text).size
+    assert_equal [], Rinku.extract_links("no links here")
+
+    # scratch buffers are reused, but never with what they held before
+    assert_equal links.size * 5000, Rinku.extract_links(text * 5000).size
+    assert_equal links, Rinku.extract_links(text)
+  end
+
+  def test_relink
+    linker = Rinku::Linker.new(link_attr: 'rel="nofollow"')
+    text = "See www.pokemon.com or <pre>http://skip.me</pre> mail ash@pokemon.com, then http://pikachu.com/(x)"
+    links = linker.extract_links(text)
+
+    edits = [
+      [4, 4, "http://mew.com "],          # a new link before the others
+      [8, 11, "pokedex"],                 # inside a link
+      [23, 28, ""],                       # opens the skipped element up
+      [text.index("ash"), text.index("ash"), "<pre>"], # skips everything after it
+      [text.bytesize, text.bytesize, ".org"],
+      [0, text.bytesize, "x@y.org"],
+    ]
+
+    edits.each do |start, old_end, insert|
+      edited = text.byteslice(0, start) + insert + text.byteslice(old_end..-1)
+      html, new_links = linker.relink(edited, links, start, old_end, start + insert.bytesize)
+
+      assert_equal linker.auto_link(edited), html
+      assert_equal linker.extract_links(edited), new_links
+      assert_equal linker.auto_link(edited) { |l| l.upcase },
+        linker.relink(edited, links, start, old_end, start + insert.bytesize) { |l| l.upcase }.first
+    end
+
+    html, new_links = linker.relink(text, links, 0, 0, 0)
+    assert_equal [linker.auto_link(text), links], [html, new_links]
+    assert new_links.all?(&:frozen?)
+
+    # links that didn't move are handed back as they were
+    edited = text.sub("mail", "mail me")
+    start = text.index("mail") + 4
+    html, moved = linker.relink(edited, new_links, start, start, start + 3)
+    assert_equal linker.auto_link(edited), html
+    assert_same new_links.first, moved.first
+    refute_same new_links.last, moved.last
+    assert_same moved.last, linker.relink(edited, moved, 0, 0, 0).last.last
+
+    # inserted text far from any link is all that's looked at again
+    sparse = "www.a.com " + "lorem ipsum <b>dolor</b> " * 20_000 + "www.z.com"
+    sparse_links = linker.extract_links(sparse)
+    start = sparse.bytesize / 2
+    start += 1 until sparse[start] == " "
+    edited = sparse.byteslice(0, start) + " www.new.com" + sparse.byteslice(start..-1)
+    html, new_links = linker.relink(edited, sparse_links, start, start, start + 12)
+    assert_equal linker.auto_link(edited), html
+    assert_equal linker.extract_links(edited), new_links
+    assert_equal ["nothing here", []], linker.relink("nothing here", [], 0, 0, 0)
+
+    assert_raises(ArgumentError) { linker.relink(text, [[0, text.bytesize + 1, :url]], 0, 0, 0) }
+    assert_raises(ArgumentError) { linker.relink(text, links.reverse, 0, 0, 0) }
+    assert_raises(ArgumentError) { linker.relink(text, links, 5, 4, 5) }
+    assert_raises(TypeError) { linker.relink(text, [[0, 3, :ftp]], 0, 0, 0) }
+  end
+
+  def test_escape_html
+    texts = [
+      "a < b & c > d \"q\" 'x'",
+      "see http://a.com/?a=1&b=2 now",
+      "<http://a.com> and www.b.com's page",
+      "mail <ash@pokemon.com>",
+      "<script>alert(1)</script> http://x.com/\"onmouseover=\"x",
+      "(http://www.pokemon.com/Pikachu_(Electric)&) \"www.a.com\"",
+    ]
+
+    texts.each do |text|
+      escaped = CGI.escapeHTML(text)
+      assert_equal Rinku.auto_link(escaped, :all, nil, []),
+        Rinku.auto_link(text, :all, nil, nil, Rinku::ESCAPE_HTML)
+    end
+
+    assert_equal "no links &amp; &lt;tags&gt;",
+      Rinku.auto_link("no links & <tags>", :all, nil, nil, Rinku::ESCAPE_HTML)
+    assert_equal %(&lt;a&gt;<a href="http://www.a.com">www.a.com</a>&lt;/a&gt;),
+      Rinku.auto_link("<a>www.a.com</a>", :all, nil, nil, Rinku::ESCAPE_HTML)
+
+    linker = Rinku::Linker.new(flags: Rinku::ESCAPE_HTML)
+    text = "x & www.a.com <b>"
+    assert_equal Rinku.auto_link(text, :all, nil, nil, Rinku::ESCAPE_HTML), linker.auto_link(text)
+    assert_equal [linker.auto_link(text)], linker.auto_link_many([text])
+    assert_equal linker.auto_link(text), linker.auto_link_stream(text.chars).to_a.join
+    assert_equal %(x &amp; <a href="http://www.a.com">WWW.A.COM</a> &lt;b&gt;),
+      linker.auto_link(text) { |link| link.upcase }
+  end
+
+  def test_stream_matches_auto_link
+    linker = Rinku::Linker.new
+    docs = [
+      "Go to www.pokemon.com or mail me at foo@bar.com. Thanks!",
+      "<pre class=\"x y\">http://no.link.com</pre> but http://yes.link.com\tis",
+      "(http://www.pokemon.com/Pikachu_(Electric)) <a href=\"x\">www.a.com</a>",
+      "日本 http://www.例え.テスト/パス 「www.github.com」 end",
+      "日本語のテキストです" * 3 + " www.a.com 中文\u{FFFD}www.b.com 😀 " + "한국어 텍스트 " * 4 + "x@y.org",
+    ]
+
+    docs.each do |doc|
+      bytes = doc.b
+      (1...bytes.bytesize).each do |cut|
+        stream = linker.stream
+        out = stream.feed(bytes.byteslice(0, cut).force_encoding(doc.encoding))
+        out << stream.feed(bytes.byteslice(cut..-1).force_encoding(doc.encoding))
+        out << stream.finish
+        assert_equal linker.auto_link(doc), out
+      end
+    end
+  end
+
+  def test_auto_link_stream
+    linker = Rinku::Linker.new(skip_tags: ["code"])
+    chunks = ["See http://www.poke", "mon.com and <co", "de>www.no", ".com</code> bye"]
+    out = []
+
+    linker.auto_link_stream(chunks) { |html| out << html }
+    assert_equal linker.auto_link(chunks.join), out.join
+    assert out.size > 1
+
+    stream = linker.stream
+    assert_equal "", stream.feed("www.pokemon.com")
+    assert_equal "<a href=\"http://www.pokemon.com\">www.pokemon.com</a>", stream.finish
+    assert_equal "done", stream.feed("done") + stream.finish
+  end
+
+  def test_stream_holds_back_little
+    linker = Rinku::Linker.new
+    fills = ["x", "\xff".b.force_encoding("UTF-8"), "y"]
+
+    ["a < b ", "a ", "a "].zip(fills).each do |head, fill|
+      stream = linker.stream
+      fed = head.bytesize
+      out = stream.feed(head).bytesize
+      chunk = fill * (1024 * 1024)
+
+      17.times do
+        fed += chunk.bytesize
+        out += stream.feed(chunk).bytesize
+        assert_operator fed - out, :<=, 64 * 1024
+      end
+
+      assert_equal fed, out + stream.finish.bytesize
+    end
+
+    stream = linker.stream
+    text = "a < b " + "x" * (17 * 1024 * 1024)
+    assert_equal text, stream.feed(text) + stream.finish
+  end
+
+  def test_stats
+    Rinku.reset_stats
+    Rinku.auto_link("www.github.com <a href='x'>www.a.com</a> x@y.com") { |l| l }
+    stats = Rinku.stats
+    skip "built without --enable-stats" unless stats
+
+    assert_equal 1, stats[:www_matches]
+    assert_equal 1, stats[:email_matches]
+    assert_equal 1, stats[:tag_triggers]
+    assert_operator stats[:skipped_tag_bytes], :>=, "<a href='x'>www.a.com</a".bytesize
+    assert_operator stats[:callback_ns], :>, 0
+
+    Rinku.reset_stats
+    assert_equal 0, Rinku.stats[:bytes_scanned]
+    assert_equal 1, Thread.new { Rinku.auto_link("www.a.com"); Rinku.stats[:www_matches] }.value
+    assert_equal 0, Rinku.stats[:www_matches]
+  end
+
+  def test_email_runs_are_linear
+    text = "a@" * 65536 + "b.com"
+    # rescanning the run for every '@' takes several seconds here
+    linked = Timeout.timeout(1) { Rinku.auto_link(text) }
+    assert_equal "a@" * 65535 + generate_result("a@b.com", "mailto:a@b.com"), linked
+  end
+
   def test_regression_84
     assert_linked "<a href=\"https://www.keepright.atの情報をもとにエラー修正\">https://www.keepright.atの情報をもとにエラー修正</a>", "https://www.keepright.atの情報をもとにエラー修正"
   end